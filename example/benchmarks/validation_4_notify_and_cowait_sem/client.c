@@ -74,6 +74,8 @@ void init(void) {
 
 void notified(microkit_channel channel) {
     if (channel == 1) {
+        // LIBMICROKITCO_PREEMPTIVE_UNBLOCK is defined, so signal only marks the runner ready.
         microkit_cothread_semaphore_signal(&io_sem);
+        microkit_cothread_run_ready();
     }
 }
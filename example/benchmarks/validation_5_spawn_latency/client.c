@@ -0,0 +1,86 @@
+#include <microkit.h>
+#include <serial_drv/printf.h>
+#include <libmicrokitco.h>
+
+#if defined(__aarch64__)
+    #include "sel4bench_aarch64.h"
+#elif defined(__riscv)
+    #include "sel4bench_riscv64.h"
+#else
+    #error "err: unsupported processor, compiler or operating system"
+#endif
+
+uintptr_t uart_base;
+uintptr_t co_mem;
+uintptr_t co_stack_4k;
+uintptr_t co_stack_16k;
+uintptr_t co_stack_64k;
+
+#define WARMUP_PASSES 8
+#define MEASURE_PASSES 32
+#define NUM_SIZES 3
+
+static const size_t stack_sizes[NUM_SIZES] = { 0x1000, 0x4000, 0x10000 };
+
+uint64_t sum_t;
+uint64_t sum_sq;
+uint64_t result;
+uint64_t prev_cycle_count;
+
+static void noop(void) {}
+
+static void FASTFN run(size_t stack_size) {
+    microkit_cothread_spawn_sized(noop, 0, stack_size);
+}
+
+static void FASTFN measure(size_t stack_size) {
+    prev_cycle_count = sel4bench_get_cycle_count();
+
+    run(stack_size);
+
+    result = sel4bench_get_cycle_count() - prev_cycle_count;
+
+    sum_t += result;
+    sum_sq += result * result;
+
+    // Let the cothread run and return so it's stack is free for the next pass.
+    microkit_cothread_yield();
+}
+
+void init(void) {
+    const microkit_cothread_stack_pool_t pools[NUM_SIZES] = {
+        { stack_sizes[0], 1, &co_stack_4k },
+        { stack_sizes[1], 1, &co_stack_16k },
+        { stack_sizes[2], 1, &co_stack_64k },
+    };
+    microkit_cothread_init_stack_pools((co_control_t *) co_mem, pools, NUM_SIZES);
+
+    sddf_printf_("Starting spawn latency benchmark\n");
+    sel4bench_init();
+    sel4bench_get_cycle_count();
+
+    for (int s = 0; s < NUM_SIZES; s++) {
+        sum_t = 0;
+        sum_sq = 0;
+        result = 0;
+        prev_cycle_count = 0;
+
+        for (int i = 0; i < WARMUP_PASSES; i++) {
+            run(stack_sizes[s]);
+            microkit_cothread_yield();
+        }
+        for (int i = 0; i < MEASURE_PASSES; i++) {
+            measure(stack_sizes[s]);
+        }
+
+        sddf_printf_("Result for stack size %lu:\n", stack_sizes[s]);
+
+        sddf_printf_("Mean: %lu\n", sum_t / MEASURE_PASSES);
+        sddf_printf_("Stdev = sqrt(%lu)\n", ((MEASURE_PASSES * sum_sq - (sum_t * sum_t)) / (MEASURE_PASSES * (MEASURE_PASSES - 1))));
+    }
+
+    sddf_printf_("BENCHFINISHED\n");
+}
+
+void notified(microkit_channel channel) {
+}
@@ -0,0 +1,3 @@
+#define LIBMICROKITCO_MAX_COTHREADS 4
+// Uncomment to measure spawn with the co-stack zeroed first.
+// #define LIBMICROKITCO_ZERO_STACKS
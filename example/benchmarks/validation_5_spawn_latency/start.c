@@ -0,0 +1,9 @@
+#include <microkit.h>
+
+void init(void) {
+    microkit_notify(4);
+}
+
+void notified(microkit_channel channel) {
+    
+}
@@ -2,72 +2,47 @@
 #include "libco.h"
 #include "settings.h"
 
+#include <stdint.h>
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-inline void panic(void) {
+static inline void panic(void) {
     char *panic_addr = (char *) 0;
     *panic_addr = (char) 0;
 }
 
-static thread_local long long co_active_buffer[64];
-static thread_local cothread_t co_active_handle = 0;
-
-section(text)
-/* ABI: SystemV */
-const unsigned char co_swap_function[4096] = {
-  0x48, 0x89, 0x26,        /* mov [rsi],rsp    */
-  0x48, 0x8b, 0x27,        /* mov rsp,[rdi]    */
-  0x58,                    /* pop rax          */
-  0x48, 0x89, 0x6e, 0x08,  /* mov [rsi+ 8],rbp */
-  0x48, 0x89, 0x5e, 0x10,  /* mov [rsi+16],rbx */
-  0x4c, 0x89, 0x66, 0x18,  /* mov [rsi+24],r12 */
-  0x4c, 0x89, 0x6e, 0x20,  /* mov [rsi+32],r13 */
-  0x4c, 0x89, 0x76, 0x28,  /* mov [rsi+40],r14 */
-  0x4c, 0x89, 0x7e, 0x30,  /* mov [rsi+48],r15 */
-  0x48, 0x8b, 0x6f, 0x08,  /* mov rbp,[rdi+ 8] */
-  0x48, 0x8b, 0x5f, 0x10,  /* mov rbx,[rdi+16] */
-  0x4c, 0x8b, 0x67, 0x18,  /* mov r12,[rdi+24] */
-  0x4c, 0x8b, 0x6f, 0x20,  /* mov r13,[rdi+32] */
-  0x4c, 0x8b, 0x77, 0x28,  /* mov r14,[rdi+40] */
-  0x4c, 0x8b, 0x7f, 0x30,  /* mov r15,[rdi+48] */
-  0xff, 0xe0,              /* jmp rax          */
-};
+// Cothread context memory layout, same as the other 64-bit ports:
+// base | ... | <-stack top | sp | pc | fp | entry | top
+// rbx and r12 to r15 are clobbered by co_switch() in libco.h rather than saved here.
 
-static void (*co_swap)(cothread_t, cothread_t) = (void (*)(cothread_t, cothread_t))co_swap_function;
+static thread_local uintptr_t co_active_buffer[co_context_words];
+thread_local cothread_t co_active_handle = co_active_buffer;
 
-static void co_entrypoint(cothread_t handle) {
-  long long* buffer = (long long*)handle;
-  void (*entrypoint)(void) = (void (*)(void))buffer[1];
+static void co_entrypoint(void) {
+  uintptr_t *context = (uintptr_t *)co_active_handle;
+  void (*entrypoint)(void) = (void (*)(void))context[co_context_entry];
   entrypoint();
   panic();  /* Panic if cothread_t entrypoint returns */
 }
 
 cothread_t co_active(void) {
-  if(!co_active_handle) co_active_handle = &co_active_buffer;
   return co_active_handle;
 }
 
 cothread_t co_derive(void* memory, unsigned int size, void (*entrypoint)(void)) {
-  cothread_t handle;
-  if(!co_active_handle) co_active_handle = &co_active_buffer;
+  uintptr_t *context = (uintptr_t *)memory + size / sizeof(uintptr_t) - co_context_words;
+  uintptr_t *p = (uintptr_t *)((uintptr_t)context & ~15);  /* seek to top of stack */
+  *--p = 0;                                                /* crash if entrypoint returns */
 
-  if(handle = (cothread_t)memory) {
-    unsigned int offset = (size & ~15) - 32;
-    long long *p = (long long*)((char*)handle + offset);  /* seek to top of stack */
-    *--p = (long long)0;                                  /* crash if entrypoint returns */
-    *--p = (long long)co_entrypoint;
-    ((long long*)handle)[0] = (long long)p;               /* stack pointer */
-    ((long long*)handle)[1] = (long long)entrypoint;      /* start of function */
-  }
-
-  return handle;
-}
+  context[co_context_sp] = (uintptr_t)p;                   /* as if co_entrypoint was called */
+  context[co_context_pc] = (uintptr_t)co_entrypoint;
+  context[co_context_fp] = 0;
+  context[co_context_entry] = (uintptr_t)entrypoint;
 
-void co_switch(cothread_t handle) {
-  register cothread_t co_previous_handle = co_active_handle;
-  co_swap(co_active_handle = handle, co_previous_handle);
+  return context;
 }
 
 #ifdef __cplusplus
@@ -10,7 +10,109 @@ typedef void* cothread_t;
 
 cothread_t co_active(void);
 cothread_t co_derive(void*, unsigned int, void (*)(void));
+
+#if defined(__clang__) || defined(__GNUC__)
+  #if defined(__aarch64__) || defined(__amd64__) || (defined(__riscv) && __riscv_xlen == 64)
+    #define LIBCO_INLINE_SWITCH
+  #endif
+#endif
+
+#ifdef LIBCO_INLINE_SWITCH
+
+// Context of a suspended cothread, the handle points to the first word. Only the stack pointer, frame
+// pointer and resume address are stored: every other register is declared clobbered by the switch so the
+// compiler spills just what is live at each call site onto the suspended cothread's own stack.
+enum {
+  co_context_sp,
+  co_context_pc,
+  co_context_fp,
+  co_context_entry, // entrypoint of a cothread that has not started yet
+  co_context_words
+};
+
+#if defined(LIBCO_MP)
+extern __thread cothread_t co_active_handle;
+#else
+extern cothread_t co_active_handle;
+#endif
+
+static inline __attribute__((always_inline)) void co_switch(cothread_t handle) {
+#if defined(__aarch64__)
+  register cothread_t to __asm__("x0") = handle;
+  register cothread_t from __asm__("x1") = co_active_handle;
+  co_active_handle = handle;
+  __asm__ volatile(
+    "adr x2, 1f\n"
+    "mov x3, sp\n"
+    "stp x3, x2, [x1]\n"
+    "str x29, [x1, #16]\n"
+    "ldp x3, x2, [x0]\n"
+    "ldr x29, [x0, #16]\n"
+    "mov sp, x3\n"
+    "br x2\n"
+    "1:\n"
+    : "+r"(to), "+r"(from)
+    :
+    : "x2", "x3", "x4", "x5", "x6", "x7", "x8", "x9", "x10", "x11", "x12", "x13", "x14", "x15",
+      "x16", "x17", "x18", "x19", "x20", "x21", "x22", "x23", "x24", "x25", "x26", "x27", "x28", "x30",
+#if defined(__ARM_FP) || defined(__ARM_NEON)
+      "v0", "v1", "v2", "v3", "v4", "v5", "v6", "v7", "v8", "v9", "v10", "v11", "v12", "v13", "v14", "v15",
+      "v16", "v17", "v18", "v19", "v20", "v21", "v22", "v23", "v24", "v25", "v26", "v27", "v28", "v29", "v30", "v31",
+#endif
+      "cc", "memory"
+  );
+#elif defined(__amd64__)
+  register cothread_t to __asm__("rdi") = handle;
+  register cothread_t from __asm__("rsi") = co_active_handle;
+  co_active_handle = handle;
+  __asm__ volatile(
+    "leaq 1f(%%rip), %%rax\n"
+    "movq %%rsp, 0(%%rsi)\n"
+    "movq %%rax, 8(%%rsi)\n"
+    "movq %%rbp, 16(%%rsi)\n"
+    "movq 0(%%rdi), %%rsp\n"
+    "movq 16(%%rdi), %%rbp\n"
+    "jmpq *8(%%rdi)\n"
+    "1:\n"
+    : "+r"(to), "+r"(from)
+    :
+    : "rax", "rbx", "rcx", "rdx", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+#if defined(__SSE__)
+      "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7",
+      "xmm8", "xmm9", "xmm10", "xmm11", "xmm12", "xmm13", "xmm14", "xmm15",
+#endif
+      "cc", "memory"
+  );
+#elif defined(__riscv)
+  register cothread_t to __asm__("a0") = handle;
+  register cothread_t from __asm__("a1") = co_active_handle;
+  co_active_handle = handle;
+  __asm__ volatile(
+    "lla t0, 1f\n"
+    "sd sp, 0(a1)\n"
+    "sd t0, 8(a1)\n"
+    "sd s0, 16(a1)\n"
+    "ld sp, 0(a0)\n"
+    "ld s0, 16(a0)\n"
+    "ld t0, 8(a0)\n"
+    "jr t0\n"
+    "1:\n"
+    : "+r"(to), "+r"(from)
+    :
+    : "ra", "t0", "t1", "t2", "t3", "t4", "t5", "t6", "a2", "a3", "a4", "a5", "a6", "a7",
+      "s1", "s2", "s3", "s4", "s5", "s6", "s7", "s8", "s9", "s10", "s11",
+#if defined(__riscv_flen)
+      "f0", "f1", "f2", "f3", "f4", "f5", "f6", "f7", "f8", "f9", "f10", "f11", "f12", "f13", "f14", "f15",
+      "f16", "f17", "f18", "f19", "f20", "f21", "f22", "f23", "f24", "f25", "f26", "f27", "f28", "f29", "f30", "f31",
+#endif
+      "memory"
+  );
+#endif
+}
+
+#else
 void co_switch(cothread_t);
+#endif
 
 #ifdef __cplusplus
 }
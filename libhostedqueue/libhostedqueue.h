@@ -6,13 +6,12 @@
 
 #pragma once
 
-#include <microkit.h>
+#include <stddef.h>
+#include <stdint.h>
 
-// A simple fixed capacity circular queue of `microkit_cothread_ref_t`s.
+// A simple fixed capacity circular queue of items of any size, copied in and out by value.
 
-// "Hosted" meaning the user of the library provides the memory.
-
-#define ITEM_TYPE microkit_cothread_ref_t
+// "Hosted" meaning the user of the library provides the memory, which must be at least capacity * item_size bytes.
 
 // return codes:
 #define LIBHOSTEDQUEUE_NOERR 0
@@ -23,6 +22,7 @@
 typedef struct {
     unsigned capacity;
     unsigned items;
+    size_t item_size;
 
     // points to item at front
     unsigned head;
@@ -30,48 +30,68 @@ typedef struct {
     unsigned tail;
 } hosted_queue_t;
 
-static inline int hostedqueue_init(hosted_queue_t *queue_controller, const unsigned capacity) {
-    if (capacity < 1) {
+// Copy one item, a word at a time when both ends allow it. Pointer sized items, the common case, are a single move.
+static inline void hostedqueue_copy_item(void *dst, const void *src, const size_t item_size) {
+    if (!(((uintptr_t) dst | (uintptr_t) src | item_size) & (sizeof(uintptr_t) - 1))) {
+        for (size_t i = 0; i < item_size / sizeof(uintptr_t); i++) {
+            ((uintptr_t *) dst)[i] = ((const uintptr_t *) src)[i];
+        }
+    } else {
+        for (size_t i = 0; i < item_size; i++) {
+            ((unsigned char *) dst)[i] = ((const unsigned char *) src)[i];
+        }
+    }
+}
+
+static inline int hostedqueue_init(hosted_queue_t *queue_controller, const unsigned capacity, const size_t item_size) {
+    if (capacity < 1 || item_size < 1) {
         return LIBHOSTEDQUEUE_ERR_INVALID_ARGS;
     }
 
     queue_controller->capacity = capacity;
     queue_controller->items = 0;
+    queue_controller->item_size = item_size;
     queue_controller->head = 0;
     queue_controller->tail = 0;
     return LIBHOSTEDQUEUE_NOERR;
 }
 
-static inline int hostedqueue_peek(const hosted_queue_t *queue_controller, const ITEM_TYPE *queue_memory, ITEM_TYPE *ret) {
+static inline int hostedqueue_peek(const hosted_queue_t *queue_controller, const void *queue_memory, void *ret) {
     if (!queue_controller->items) {
         return LIBHOSTEDQUEUE_ERR_EMPTY;
     }
 
-    *ret = queue_memory[queue_controller->head];
+    const size_t item_size = queue_controller->item_size;
+    hostedqueue_copy_item(ret, (const unsigned char *) queue_memory + queue_controller->head * item_size, item_size);
 
     return LIBHOSTEDQUEUE_NOERR;
 }
 
-static inline int hostedqueue_pop(hosted_queue_t *queue_controller, ITEM_TYPE *queue_memory, ITEM_TYPE *ret) {
+static inline int hostedqueue_pop(hosted_queue_t *queue_controller, void *queue_memory, void *ret) {
     int err = hostedqueue_peek(queue_controller, queue_memory, ret);
     if (err == LIBHOSTEDQUEUE_NOERR) {
         queue_controller->head += 1;
-        queue_controller->head %= queue_controller->capacity;
+        if (queue_controller->head == queue_controller->capacity) {
+            queue_controller->head = 0;
+        }
         queue_controller->items -= 1;
     }
     return err;
 }
 
-static inline int hostedqueue_push(hosted_queue_t *queue_controller, ITEM_TYPE *queue_memory, const ITEM_TYPE *item) {
+static inline int hostedqueue_push(hosted_queue_t *queue_controller, void *queue_memory, const void *item) {
     if (queue_controller->items == queue_controller->capacity) {
         return LIBHOSTEDQUEUE_ERR_FULL;
     }
 
-    queue_memory[queue_controller->tail] = *item;
+    const size_t item_size = queue_controller->item_size;
+    hostedqueue_copy_item((unsigned char *) queue_memory + queue_controller->tail * item_size, item, item_size);
 
     queue_controller->items += 1;
     queue_controller->tail += 1;
-    queue_controller->tail %= queue_controller->capacity;
+    if (queue_controller->tail == queue_controller->capacity) {
+        queue_controller->tail = 0;
+    }
 
     return LIBHOSTEDQUEUE_NOERR;
 }
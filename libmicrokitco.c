@@ -7,6 +7,7 @@
 #include <microkit.h>
 #include <stdint.h>
 #include <stdarg.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <sel4/sel4.h>
 
@@ -15,10 +16,22 @@
 #pragma GCC diagnostic error "-Wpedantic"
 #pragma GCC diagnostic push
 
-/* Very simple memzero implementation */
+/* Very simple memzero implementation, a word at a time once dst is aligned */
 static void memzero(void *dst, size_t n) {
-    for (int i = 0; i < n; i++) {
-        ((char *)dst)[i] = 0;
+    char *bytes = (char *) dst;
+    while (n && ((uintptr_t) bytes & (sizeof(uintptr_t) - 1))) {
+        *bytes++ = 0;
+        n--;
+    }
+
+    uintptr_t *words = (uintptr_t *) bytes;
+    for (size_t i = 0; i < n / sizeof(uintptr_t); i++) {
+        words[i] = 0;
+    }
+
+    bytes = (char *) &words[n / sizeof(uintptr_t)];
+    for (size_t i = 0; i < n % sizeof(uintptr_t); i++) {
+        bytes[i] = 0;
     }
 }
 
@@ -30,6 +43,10 @@ void microkit_cothread_panic(uintptr_t err) {
 
 #include <libco.h>
 
+#if defined(LIBMICROKITCO_SHARED_STACK) && !defined(LIBCO_INLINE_SWITCH)
+#error "libmicrokitco: shared_stack needs the cothread context layout of the bundled libco."
+#endif
+
 // Error handling
 // On an unrecoverable error, such as bad argument or bugs in the implementation.
 // libmicrokitco will crash the client PD with one of the following error code as
@@ -37,365 +54,2410 @@ void microkit_cothread_panic(uintptr_t err) {
 typedef enum {
     reserved = 0, // so that internal error code starts from 1 for easy identification.
     cannot_destroy_self_after_return,
-    co_err_sem_sig_once_cannot_schedule_caller,
+    chan_block_called_from_root,
+    chan_init_invalid_args,
+    channel_sem_invalid_channel,
+    cond_wait_called_from_root,
+    cond_wait_mutex_not_owned,
     destroy_cannot_destroy_root,
-    destroy_cannot_release_handle,
     destroy_already_not_initialised,
+    event_loop_called_from_non_root_cothread,
+    event_loop_unexpected_fault,
+    future_already_completed,
+    future_await_called_from_root,
+    future_await_invalid_args,
     generic_invalid_handle,
     init_already_initialised,
+    init_arena_invalid_layout,
+    init_arena_too_small,
     init_co_stack_null,
     init_co_stack_overlap,
-    init_free_handles_init_fail,
-    init_free_handles_populate_fail,
+    init_controller_too_small,
     init_num_costacks_not_equal_defined,
-    init_sched_init_fail,
+    init_shared_stack_null,
+    init_stack_pools_not_ascending,
     init_stack_too_small,
-    internal_pop_from_queue_cannot_pop,
-    internal_pop_from_queue_found_non_ready_cothread_in_schedule_queue,
+    join_already_joined,
+    join_called_from_root,
+    join_cannot_join_self,
+    join_not_joinable,
+    mutex_lock_called_from_root,
+    mutex_lock_recursive,
+    mutex_unlock_not_owner,
     my_arg_called_from_root,
+    pool_init_invalid_args,
+    pool_submit_fn_is_null,
     recv_ntfn_called_from_non_root_cothread,
     recv_ntfn_invalid_channel,
-    spawn_cannot_schedule_new,
+    run_ready_called_from_non_root_cothread,
+    sem_init_invalid_count,
+    sem_wait_invalid_count,
+    set_prio_invalid_priority,
+    shared_stack_save_overflow,
     spawn_client_entry_is_null,
+    spawn_invalid_priority,
+    spawn_task_entry_is_null,
+    stack_overflow_detected,
+    task_cannot_block,
+    timed_wait_called_from_root,
+    timer_init_already_initialised,
+    timer_init_invalid_args,
+    timer_not_initialised,
     wait_on_channel_invalid_channel,
-    yield_cannot_schedule_caller,
+    wait_on_channels_invalid_mask,
 } internal_co_fatal_errors_t;
 
 // =========== Business logic ===========
 
+#define EVENT_LOOP_CHANNEL_BITS 0x3f
 #define LIBMICROKITCO_ROOT_THREAD 0
 #define MINIMUM_STACK_SIZE 0x1000 // Minimum is page size
+#define MINIMUM_SAVE_BUFFER_SIZE 0x100
 #define SCHEDULER_NULL_CHOICE LIBMICROKITCO_NULL_HANDLE
+#define STACK_PAINT_WORD ((uintptr_t) 0xc0dec0dec0dec0deull)
+#define TIMER_NOT_QUEUED -1
+
+// Number of cothreads and of all handles, constants unless the controller is sized at runtime.
+#ifdef LIBMICROKITCO_MAX_COTHREADS
+#define NUM_COTHREADS LIBMICROKITCO_MAX_COTHREADS
+#else
+#define NUM_COTHREADS (co_controller->max_cothreads)
+#endif
+#define NUM_HANDLES (NUM_COTHREADS + LIBMICROKITCO_MAX_TASKS)
+
+// Bytes below the stack pointer that a leaf function may use without moving it.
+#if defined(__amd64__)
+#define STACK_RED_ZONE 128
+#else
+#define STACK_RED_ZONE 0
+#endif
+
+#if defined(LIBMICROKITCO_POLL_INTERVAL) || defined(LIBMICROKITCO_POLL_CYCLES)
+#define LIBMICROKITCO_POLLING
+#endif
+
+#if defined(LIBMICROKITCO_TIME_SLICE) || defined(LIBMICROKITCO_POLL_CYCLES)
+// The cycle counter that the benchmarks read through sel4bench, it must be readable from user level.
+static inline uint64_t internal_cycle_count(void) {
+#if defined(LIBMICROKITCO_CYCLE_COUNT)
+    return LIBMICROKITCO_CYCLE_COUNT();
+#elif defined(__aarch64__)
+    uint64_t cycles;
+    asm volatile("mrs %0, pmccntr_el0" : "=r"(cycles));
+    return cycles;
+#elif defined(__riscv)
+    uint64_t cycles;
+    asm volatile("rdcycle %0" : "=r"(cycles));
+    return cycles;
+#elif defined(__x86_64__)
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t) hi << 32) | lo;
+#else
+#error "libmicrokitco: no cycle counter known for this architecture, define LIBMICROKITCO_CYCLE_COUNT()."
+#endif
+}
+#endif
 
 // each PD can only have one "instance" of this library running.
 static co_control_t *co_controller = NULL;
 
 // =========== Helper functions ===========
 
-// Pick a ready thread, essentially popping the first item from the scheduling queue.
-static inline microkit_cothread_ref_t internal_schedule(void) {
-    microkit_cothread_ref_t next_choice;
+// Intrusive doubly linked lists threaded through the TCBs. A cothread is in at most one list at a time:
+// either a scheduling queue when ready or the waiting queue of whatever it is blocked on.
+static inline bool internal_list_is_empty(const co_list_t *list) {
+    return list->head == LIBMICROKITCO_NULL_HANDLE;
+}
 
-    while (true) {
-        // This loop will iterate 2 >= times if client destroy a ready cothread. It's TCB will be inactive but it is still
-        // in the scheduling queue, we need to gracefully handle this.
-        const int peek_err = hostedqueue_pop(&co_controller->scheduling_queue, co_controller->scheduling_queue_mem, &next_choice);
-        if (peek_err == LIBHOSTEDQUEUE_ERR_EMPTY) {
-            next_choice = SCHEDULER_NULL_CHOICE;
-            break;
-        } else if (peek_err == LIBHOSTEDQUEUE_NOERR) {
-            if (next_choice == LIBMICROKITCO_ROOT_THREAD) {
-                break;
-            } else if (co_controller->tcbs[next_choice].state == cothread_ready) {
-                break;
-            } else {
-                continue;
-            }
-        } else {
-            // catch other errs
-            microkit_cothread_panic(internal_pop_from_queue_cannot_pop);
-        }
+static inline void internal_list_append(co_list_t *list, const microkit_cothread_ref_t cothread) {
+    co_tcb_t *tcb = &co_controller->tcbs[cothread];
+    tcb->next = LIBMICROKITCO_NULL_HANDLE;
+    tcb->prev = list->tail;
+
+    if (list->tail == LIBMICROKITCO_NULL_HANDLE) {
+        list->head = cothread;
+    } else {
+        co_controller->tcbs[list->tail].next = cothread;
+    }
+    list->tail = cothread;
+}
+
+static inline void internal_list_remove(co_list_t *list, const microkit_cothread_ref_t cothread) {
+    co_tcb_t *tcb = &co_controller->tcbs[cothread];
+
+    if (tcb->prev == LIBMICROKITCO_NULL_HANDLE) {
+        list->head = tcb->next;
+    } else {
+        co_controller->tcbs[tcb->prev].next = tcb->next;
+    }
+    if (tcb->next == LIBMICROKITCO_NULL_HANDLE) {
+        list->tail = tcb->prev;
+    } else {
+        co_controller->tcbs[tcb->next].prev = tcb->prev;
     }
 
-    return next_choice;
+    tcb->next = LIBMICROKITCO_NULL_HANDLE;
+    tcb->prev = LIBMICROKITCO_NULL_HANDLE;
 }
 
-// Switch to the next ready thread, also handle cases where there is no ready thread.
-static inline void internal_go_next(void) {
-    microkit_cothread_ref_t next = internal_schedule();
-    if (next == SCHEDULER_NULL_CHOICE) {
-        // no ready thread in the queue, go back to root execution thread to receive notifications
-        next = 0;
+// Move every cothread in `src` to the back of `dst` in order, leaving `src` empty.
+static inline void internal_list_splice(co_list_t *dst, co_list_t *src) {
+    if (internal_list_is_empty(src)) {
+        return;
     }
 
-    co_controller->tcbs[next].state = cothread_running;
-    co_controller->running = next;
-    co_switch(co_controller->tcbs[next].co_handle);
+    if (dst->tail == LIBMICROKITCO_NULL_HANDLE) {
+        dst->head = src->head;
+    } else {
+        co_controller->tcbs[dst->tail].next = src->head;
+        co_controller->tcbs[src->head].prev = dst->tail;
+    }
+    dst->tail = src->tail;
+
+    src->head = LIBMICROKITCO_NULL_HANDLE;
+    src->tail = LIBMICROKITCO_NULL_HANDLE;
 }
 
-static inline void cothread_entry_wrapper(void) {
-    // Execute the client entry point
-    co_controller->tcbs[co_controller->running].client_entry();
+// Returns LIBMICROKITCO_NULL_HANDLE if the list is empty.
+static inline microkit_cothread_ref_t internal_list_pop(co_list_t *list) {
+    const microkit_cothread_ref_t head = list->head;
+    if (head != LIBMICROKITCO_NULL_HANDLE) {
+        internal_list_remove(list, head);
+    }
+    return head;
+}
 
-    // Clean up after ourselves
-    microkit_cothread_destroy(co_controller->running);
+// Block the running cothread on `list`, which is the waiting queue of `sem` if given, or on nothing but a timeout
+// if `list` is NULL. Where it is blocked is remembered for destroy().
+static inline void internal_block_on(co_list_t *list, struct microkit_cothread_sem *sem) {
+    co_tcb_t *tcb = &co_controller->tcbs[co_controller->running];
+    tcb->state = cothread_blocked;
+    tcb->wait_list = list;
+    tcb->wait_sem = sem;
+    if (list) {
+        internal_list_append(list, co_controller->running);
+    }
+}
 
-    // Should not return
-    microkit_cothread_panic(cannot_destroy_self_after_return);
+// Only cothreads have a stack to block on, tasks use the MICROKIT_COTHREAD_TASK_* macros instead.
+static inline void internal_check_can_block(void) {
+#if LIBMICROKITCO_MAX_TASKS
+    if (co_controller->running >= NUM_COTHREADS) {
+        microkit_cothread_panic(task_cannot_block);
+    }
+#endif
 }
 
-// =========== Semaphores ===========
+// Place a cothread at the back of the scheduling queue of its priority.
+static inline void internal_sched_push(const microkit_cothread_ref_t cothread) {
+    const microkit_cothread_prio_t prio = co_controller->tcbs[cothread].priority;
+    internal_list_append(&co_controller->scheduling_queues[prio], cothread);
+    co_controller->ready_bitmap |= 1u << prio;
+}
 
-void microkit_cothread_semaphore_init(microkit_cothread_sem_t *ret_sem) {
-    ret_sem->head = LIBMICROKITCO_NULL_HANDLE;
-    ret_sem->tail = LIBMICROKITCO_NULL_HANDLE;
-    ret_sem->set = false;
+// Mark a cothread ready and place it at the back of the scheduling queue of its priority.
+static inline void internal_make_ready(const microkit_cothread_ref_t cothread) {
+    co_controller->tcbs[cothread].state = cothread_ready;
+    internal_sched_push(cothread);
 }
 
-void microkit_cothread_semaphore_wait(microkit_cothread_sem_t *sem) {
-    if (sem->set) {
-        sem->set = false;
-    } else {
-        co_controller->tcbs[co_controller->running].state = cothread_blocked;
-        if (sem->head == LIBMICROKITCO_NULL_HANDLE) {
-            sem->head = co_controller->running;
-            sem->tail = co_controller->running;
-        } else {
-            co_controller->tcbs[sem->tail].next_blocked_on_same_event = co_controller->running;
-            sem->tail = co_controller->running;
-        }
-        internal_go_next();
+// Take a ready cothread out of the scheduling queue of the given priority.
+static inline void internal_sched_remove(const microkit_cothread_ref_t cothread, const microkit_cothread_prio_t prio) {
+    co_list_t *queue = &co_controller->scheduling_queues[prio];
+    internal_list_remove(queue, cothread);
+    if (internal_list_is_empty(queue)) {
+        co_controller->ready_bitmap &= ~(1u << prio);
     }
 }
 
-void microkit_cothread_semaphore_signal(microkit_cothread_sem_t *sem) {
-    if (microkit_cothread_semaphore_is_set(sem)) {
+// Change the priority a cothread is scheduled at. A ready cothread must move to the queue of it's new priority,
+// blocked and running cothreads pick up the new priority the next time they are scheduled.
+static inline void internal_change_prio(const microkit_cothread_ref_t cothread, const microkit_cothread_prio_t priority) {
+    const microkit_cothread_prio_t old_priority = co_controller->tcbs[cothread].priority;
+    if (old_priority == priority) {
         return;
     }
 
-    if (microkit_cothread_semaphore_is_queue_empty(sem)) {
-        sem->set = true;
-        return;
+    co_controller->tcbs[cothread].priority = priority;
+    if (co_controller->tcbs[cothread].state == cothread_ready) {
+        internal_sched_remove(cothread, old_priority);
+        internal_sched_push(cothread);
     }
+}
 
-    const microkit_cothread_ref_t head = sem->head;
-    const microkit_cothread_ref_t next = co_controller->tcbs[head].next_blocked_on_same_event;
+// Whether a cothread that would run before the caller if it yielded is ready, that is one of equal or higher
+// priority. With a single priority level this is one load and compare of the ready bitmap.
+static inline bool internal_yield_would_switch(void) {
+#if LIBMICROKITCO_NUM_PRIORITIES == 1
+    return co_controller->ready_bitmap;
+#else
+    return co_controller->ready_bitmap >> co_controller->tcbs[co_controller->running].priority;
+#endif
+}
 
-    // Schedule caller
-    const int sched_err = hostedqueue_push(&co_controller->scheduling_queue, co_controller->scheduling_queue_mem, &co_controller->running);
-    if (sched_err != LIBHOSTEDQUEUE_NOERR) {
-        microkit_cothread_panic(co_err_sem_sig_once_cannot_schedule_caller);
+// Pick a ready thread, essentially popping the first item from the highest priority non-empty scheduling queue.
+// The non-empty queue is found with a count leading zeros on the ready bitmap so this is constant time.
+// Every cothread in the scheduling queues is ready because destroy() unlinks ready cothreads eagerly.
+static inline microkit_cothread_ref_t internal_schedule(void) {
+    if (!co_controller->ready_bitmap) {
+        return SCHEDULER_NULL_CHOICE;
     }
-    co_controller->tcbs[co_controller->running].state = cothread_ready;
-
-    // Move semaphore list
-    sem->head = next;
-    co_controller->tcbs[head].next_blocked_on_same_event = LIBMICROKITCO_NULL_HANDLE;
 
-    if (next == LIBMICROKITCO_NULL_HANDLE) {
-        // Reset semaphore if it's waiting queue is empty
-        microkit_cothread_semaphore_init(sem);
+    const microkit_cothread_prio_t prio = 31 - __builtin_clz(co_controller->ready_bitmap);
+    co_list_t *queue = &co_controller->scheduling_queues[prio];
+    const microkit_cothread_ref_t next_choice = internal_list_pop(queue);
+    if (internal_list_is_empty(queue)) {
+        co_controller->ready_bitmap &= ~(1u << prio);
     }
 
-    // Directly switch to unblocked cothread
-    co_controller->running = head;
-    co_controller->tcbs[co_controller->running].state = cothread_running;
-    co_switch(co_controller->tcbs[co_controller->running].co_handle);
+    return next_choice;
 }
 
-bool microkit_cothread_semaphore_is_queue_empty(const microkit_cothread_sem_t *sem) {
-    return sem->head == LIBMICROKITCO_NULL_HANDLE;
+#if LIBMICROKITCO_MAX_TASKS
+static inline bool internal_is_task(const microkit_cothread_ref_t handle) {
+    return handle >= NUM_COTHREADS;
 }
 
-bool microkit_cothread_semaphore_is_set(const microkit_cothread_sem_t *sem) {
-    return sem->set;
+static inline void internal_task_release(const microkit_cothread_ref_t task) {
+    co_controller->tcbs[task].state = cothread_not_active;
+    internal_list_append(&co_controller->free_tasks, task);
 }
 
-// =========== Public functions ===========
+// Run one step of a stackless task on the caller's stack, then put it wherever it's return value says.
+static void internal_run_task(const microkit_cothread_ref_t task) {
+    co_tcb_t *tcb = &co_controller->tcbs[task];
+    const microkit_cothread_ref_t caller = co_controller->running;
 
-void microkit_cothread_init(
-    co_control_t *controller_memory_addr,
-    const size_t co_stack_size,
-    const stack_ptrs_arg_array_t co_stacks
-) {
-    if (co_controller != NULL) {
-        microkit_cothread_panic(init_already_initialised);
-    }
-    if (co_stack_size < MINIMUM_STACK_SIZE) {
-        microkit_cothread_panic(init_stack_too_small);
+    co_controller->running = task;
+    tcb->state = cothread_running;
+    const co_task_status_t status = tcb->task_entry();
+    co_controller->running = caller;
+
+    // A task that blocked is already in the semaphore's queue, and one that destroyed itself is gone.
+    if (tcb->state == cothread_running) {
+        if (status == co_task_done) {
+            internal_task_release(task);
+        } else {
+            internal_make_ready(task);
+        }
     }
+}
+#endif
 
-    // This part will VMFault on write if the given memory is not large enough.
-    memzero((void *) controller_memory_addr, LIBMICROKITCO_CONTROLLER_SIZE);
-    co_controller = controller_memory_addr;
-    co_controller->co_stack_size = co_stack_size;
+// Return a cothread handle and it's stack to the free list of it's stack pool.
+static inline void internal_release_handle(const microkit_cothread_ref_t cothread) {
+    internal_list_append(&co_controller->free_handles[co_controller->tcbs[cothread].stack_class], cothread);
+}
 
-    // Check that all the stacks are in a valid memory region
-    // Skip the zero TCB because its the root thread.
-    for (int i = 1; i < LIBMICROKITCO_MAX_COTHREADS; i++) {
-        co_controller->tcbs[i].local_storage = (void *) co_stacks[i - 1];
+// A cothread that destroyed itself keeps running on it's stack until the switch away, only then can it's
+// handle be reused.
+static inline void internal_reap(void) {
+    if (co_controller->zombie != LIBMICROKITCO_NULL_HANDLE) {
+        internal_release_handle(co_controller->zombie);
+        co_controller->zombie = LIBMICROKITCO_NULL_HANDLE;
+    }
+}
 
-        if (co_controller->tcbs[i].local_storage == 0) {
-            microkit_cothread_panic(init_co_stack_null);
-        }
+#ifdef LIBMICROKITCO_STACK_WATERMARK
+// Lowest whole word of a stack, it is only overwritten once all of the stack has been used.
+static inline uintptr_t *internal_stack_canary(const void *stack) {
+    return (uintptr_t *) (((uintptr_t) stack + sizeof(uintptr_t) - 1) & ~(sizeof(uintptr_t) - 1));
+}
 
-        // sanity check the stacks, crash if stack not as big as we think
-        // we only memzero the stack on cothread spawn.
-        char *stack = (char *) co_controller->tcbs[i].local_storage;
-        stack[0] = 0;
-        stack[co_stack_size - 1] = 0;
+static inline void internal_stack_paint(void *stack, const size_t size) {
+    const uintptr_t end = (uintptr_t) stack + size;
+    for (uintptr_t *word = internal_stack_canary(stack); (uintptr_t) (word + 1) <= end; word++) {
+        *word = STACK_PAINT_WORD;
     }
+}
 
-    // Check that none of the stacks overlap
-    for (int i = 1; i < LIBMICROKITCO_MAX_COTHREADS; i++) {
-        uintptr_t this_stack_start = (uintptr_t) co_controller->tcbs[i].local_storage;
-        uintptr_t this_stack_end = this_stack_start + co_stack_size - 1;
+// Catch a cothread that ran off the bottom of it's stack as it switches out, before anything else can run
+// on top of the damage. Tasks and the root thread have no co-stack to check.
+static inline void internal_stack_check(const microkit_cothread_ref_t outgoing) {
+#ifdef LIBMICROKITCO_SHARED_STACK
+    // Save buffers are bounds checked on every copy, it is the shared stack that can overflow.
+    (void) outgoing;
+    const void *stack = co_controller->shared_stack_bottom;
+#else
+    const void *stack = co_controller->tcbs[outgoing].local_storage;
+#endif
+    if (stack != NULL && *internal_stack_canary(stack) != STACK_PAINT_WORD) {
+        microkit_cothread_panic(stack_overflow_detected);
+    }
+}
+#endif
 
-        for (int j = 1; j < LIBMICROKITCO_MAX_COTHREADS; j++) {
-            if (j != i) {
-                uintptr_t other_stack_start = (uintptr_t) co_controller->tcbs[j].local_storage;
-                uintptr_t other_stack_end = other_stack_start + co_stack_size - 1;
+#ifdef LIBMICROKITCO_SHARED_STACK
+// Word-wise copy, both ends are word aligned.
+static inline void internal_copy_words(uintptr_t *dst, const uintptr_t *src, const size_t n_bytes) {
+    for (size_t i = 0; i < n_bytes / sizeof(uintptr_t); i++) {
+        dst[i] = src[i];
+    }
+}
 
-                if (this_stack_start <= other_stack_end && other_stack_start <= this_stack_end) {
-                    microkit_cothread_panic(init_co_stack_overlap);
-                }
-            }
+// Save the live part of the occupant's stack below it's context in it's save buffer, then copy `next`'s saved
+// stack onto the shared stack. Must not run on the shared stack.
+static void internal_shared_stack_swap(const microkit_cothread_ref_t next) {
+    const microkit_cothread_ref_t occupant = co_controller->shared_stack_occupant;
+    if (occupant != LIBMICROKITCO_NULL_HANDLE) {
+        co_tcb_t *tcb = &co_controller->tcbs[occupant];
+        const uintptr_t live_bottom = ((uintptr_t *) tcb->co_handle)[co_context_sp] - STACK_RED_ZONE;
+        const size_t live = co_controller->shared_stack_top - live_bottom;
+        if (live > (uintptr_t) tcb->co_handle - (uintptr_t) tcb->local_storage) {
+            microkit_cothread_panic(shared_stack_save_overflow);
         }
-    }
 
-    // Initialise the root thread's handle;
-    co_controller->tcbs[0].local_storage = NULL;
-    co_controller->tcbs[0].co_handle = co_active();
-    co_controller->tcbs[0].state = cothread_running;
-    co_controller->tcbs[0].next_blocked_on_same_event = LIBMICROKITCO_NULL_HANDLE;
-    co_controller->running = LIBMICROKITCO_ROOT_THREAD;
+        internal_copy_words((uintptr_t *) ((uintptr_t) tcb->co_handle - live), (uintptr_t *) live_bottom, live);
+        tcb->saved_stack_size = live;
+    }
 
-    // Initialise the queues
-    const int err_hq = hostedqueue_init(
-        &co_controller->free_handle_queue,
-        LIBMICROKITCO_MAX_COTHREADS
-    );
-    const int err_sq = hostedqueue_init(
-        &co_controller->scheduling_queue,
-        LIBMICROKITCO_MAX_COTHREADS
+    co_tcb_t *tcb = &co_controller->tcbs[next];
+    internal_copy_words(
+        (uintptr_t *) (co_controller->shared_stack_top - tcb->saved_stack_size),
+        (uintptr_t *) ((uintptr_t) tcb->co_handle - tcb->saved_stack_size),
+        tcb->saved_stack_size
     );
+    co_controller->shared_stack_occupant = next;
+}
 
-    if (err_hq != LIBHOSTEDQUEUE_NOERR) {
-        microkit_cothread_panic(init_free_handles_init_fail);
+// Runs on it's own small stack so that it can overwrite the shared stack on behalf of the cothread switching out.
+static void internal_shared_stack_swapper(void) {
+    while (true) {
+        const microkit_cothread_ref_t next = co_controller->shared_stack_swap_target;
+        internal_shared_stack_swap(next);
+        co_switch(co_controller->tcbs[next].co_handle);
     }
-    if (err_sq != LIBHOSTEDQUEUE_NOERR) {
-        microkit_cothread_panic(init_sched_init_fail);
+}
+#endif
+
+// Where something a blocked cothread passed to the library by pointer is right now.
+static inline void *internal_blocked_addr(const microkit_cothread_ref_t cothread, const void *ptr) {
+#ifdef LIBMICROKITCO_SHARED_STACK
+    // If it points into the cothread's stack and that stack has been moved to the save buffer, follow it there.
+    const co_tcb_t *tcb = &co_controller->tcbs[cothread];
+    const uintptr_t addr = (uintptr_t) ptr;
+    const uintptr_t top = co_controller->shared_stack_top;
+    if (cothread != co_controller->shared_stack_occupant && addr < top && addr >= top - tcb->saved_stack_size) {
+        return (void *) ((uintptr_t) tcb->co_handle - (top - addr));
     }
+#else
+    (void) cothread;
+#endif
+    return (void *) ptr;
+}
 
-    // Enqueue all the free cothread handle IDs but exclude the root thread.
-    for (microkit_cothread_ref_t i = 1; i < LIBMICROKITCO_MAX_COTHREADS; i++) {
-        if (hostedqueue_push(&co_controller->free_handle_queue, co_controller->free_handle_queue_mem, &i) != LIBHOSTEDQUEUE_NOERR) {
-            microkit_cothread_panic(init_free_handles_populate_fail);
+// Switch execution to `next`, the scheduling state must already be updated.
+static inline void internal_switch(const microkit_cothread_ref_t next) {
+#ifdef LIBMICROKITCO_TIME_SLICE
+    co_controller->slice_end = internal_cycle_count() + co_controller->tcbs[next].time_slice;
+#endif
+#ifdef LIBMICROKITCO_SHARED_STACK
+    if (next != LIBMICROKITCO_ROOT_THREAD && next != co_controller->shared_stack_occupant) {
+        if (co_active() == co_controller->tcbs[LIBMICROKITCO_ROOT_THREAD].co_handle) {
+            // The root thread has it's own stack so it can do the copying itself.
+            internal_shared_stack_swap(next);
+        } else {
+            co_controller->shared_stack_swap_target = next;
+            co_switch(co_controller->shared_stack_swapper);
+            internal_reap();
+            return;
         }
     }
+#endif
+    co_switch(co_controller->tcbs[next].co_handle);
+    internal_reap();
+}
 
-    // Initialise the blocked table
-    for (int i = 0; i < MICROKIT_MAX_CHANNELS; i++) {
-        microkit_cothread_semaphore_init(&co_controller->blocked_channel_map[i]);
+// Switch to the next ready thread, also handle cases where there is no ready thread.
+static inline void internal_go_next(void) {
+    microkit_cothread_ref_t next = internal_schedule();
+#if LIBMICROKITCO_MAX_TASKS
+    // Tasks have no context to switch to, run them right here until a cothread is picked.
+    while (next != SCHEDULER_NULL_CHOICE && internal_is_task(next)) {
+        internal_run_task(next);
+        next = internal_schedule();
+    }
+#endif
+    if (next == SCHEDULER_NULL_CHOICE) {
+        // no ready thread in the queue, go back to root execution thread to receive notifications
+        next = 0;
     }
+
+#ifdef LIBMICROKITCO_STACK_WATERMARK
+    internal_stack_check(co_controller->running);
+#endif
+
+    co_controller->tcbs[next].state = cothread_running;
+    co_controller->running = next;
+    internal_switch(next);
 }
 
-bool microkit_cothread_free_handle_available(microkit_cothread_ref_t *ret_handle) {
-    return hostedqueue_peek(&co_controller->free_handle_queue, co_controller->free_handle_queue_mem, ret_handle) == LIBHOSTEDQUEUE_NOERR;
+// The root thread steps aside until every ready cothread has run and blocked again, whatever their priority
+// relative to it. The scheduler falls back to the root thread once nothing is ready.
+static inline void internal_root_run_ready(void) {
+    if (co_controller->ready_bitmap) {
+        co_controller->tcbs[LIBMICROKITCO_ROOT_THREAD].state = cothread_blocked;
+        internal_go_next();
+    }
 }
 
-microkit_cothread_ref_t microkit_cothread_spawn(const client_entry_t client_entry, void *private_arg) {
-    if (!client_entry) {
-        microkit_cothread_panic(spawn_client_entry_is_null);
+// Directly switch to a cothread that was just unblocked, the caller goes to the back of the scheduling queue.
+static inline void internal_handoff(const microkit_cothread_ref_t unblocked) {
+#if LIBMICROKITCO_MAX_TASKS
+    if (internal_is_task(unblocked)) {
+        // Nothing to switch to, run it on our stack and carry on.
+        internal_run_task(unblocked);
+        return;
     }
+#endif
 
-    hosted_queue_t *free_handle_queue = &co_controller->free_handle_queue;
-    hosted_queue_t *scheduling_queue = &co_controller->scheduling_queue;
-    microkit_cothread_ref_t new;
-    const int pop_err = hostedqueue_pop(free_handle_queue, co_controller->free_handle_queue_mem, &new);
+#ifdef LIBMICROKITCO_STACK_WATERMARK
+    internal_stack_check(co_controller->running);
+#endif
 
-    if (pop_err != LIBHOSTEDQUEUE_NOERR) {
-        return LIBMICROKITCO_NULL_HANDLE;
+    // Schedule caller
+    internal_make_ready(co_controller->running);
+
+    // Directly switch to unblocked cothread
+    co_controller->running = unblocked;
+    co_controller->tcbs[co_controller->running].state = cothread_running;
+    internal_switch(unblocked);
+}
+
+static void internal_detach(const microkit_cothread_ref_t cothread);
+
+// A joinable cothread is finished: keep it's handle until it is joined and wake whoever is already joining it.
+static void internal_exit(const microkit_cothread_ref_t cothread, void *exit_value) {
+    co_tcb_t *tcb = &co_controller->tcbs[cothread];
+    internal_detach(cothread);
+    tcb->exit_value = exit_value;
+    tcb->state = cothread_exited;
+
+#ifdef LIBMICROKITCO_SHARED_STACK
+    if (cothread == co_controller->shared_stack_occupant) {
+        co_controller->shared_stack_occupant = LIBMICROKITCO_NULL_HANDLE;
     }
+#endif
 
-    unsigned char *costack = (unsigned char *) co_controller->tcbs[new].local_storage;
-    memzero(costack, co_controller->co_stack_size);
-    co_controller->tcbs[new].client_entry = client_entry;
-    co_controller->tcbs[new].private_arg = private_arg;
-    co_controller->tcbs[new].co_handle = co_derive(costack, co_controller->co_stack_size, cothread_entry_wrapper);
-    co_controller->tcbs[new].state = cothread_ready;
-    co_controller->tcbs[new].next_blocked_on_same_event = LIBMICROKITCO_NULL_HANDLE;
+    if (!internal_list_is_empty(&tcb->joiner)) {
+        internal_make_ready(internal_list_pop(&tcb->joiner));
+    }
+    if (cothread == co_controller->running) {
+        internal_go_next();
+    }
+}
 
-    const int schedule_err = hostedqueue_push(scheduling_queue, co_controller->scheduling_queue_mem, &new);
-    if (schedule_err != LIBHOSTEDQUEUE_NOERR) {
-        microkit_cothread_panic(spawn_cannot_schedule_new);
-        return LIBMICROKITCO_NULL_HANDLE;
+static inline void cothread_entry_wrapper(void) {
+    internal_reap();
+
+    // Execute the client entry point
+    co_tcb_t *tcb = &co_controller->tcbs[co_controller->running];
+    if (tcb->joinable) {
+        internal_exit(co_controller->running, tcb->joinable_entry());
     } else {
-        return new;
+        tcb->client_entry();
     }
+
+    // Clean up after ourselves
+    microkit_cothread_destroy(co_controller->running);
+
+    // Should not return
+    microkit_cothread_panic(cannot_destroy_self_after_return);
 }
 
-void microkit_cothread_set_arg(const microkit_cothread_ref_t cothread, void *private_arg) {
-    if (cothread >= LIBMICROKITCO_MAX_COTHREADS || cothread < 0 || co_controller->tcbs[cothread].state == cothread_not_active) {
-        microkit_cothread_panic(generic_invalid_handle);
+// =========== Semaphores ===========
+
+static inline void internal_timer_heap_remove(const microkit_cothread_ref_t cothread);
+
+// Take the first waiter off a semaphore, cancelling it's timeout if it is in a timed wait.
+static inline microkit_cothread_ref_t internal_sem_pop_waiter(microkit_cothread_sem_t *sem) {
+    const microkit_cothread_ref_t head = internal_list_pop(&sem->waiting);
+    if (co_controller->tcbs[head].timer_heap_idx != TIMER_NOT_QUEUED) {
+        internal_timer_heap_remove(head);
     }
+    return head;
+}
 
-    co_controller->tcbs[cothread].private_arg = private_arg;
+// Make every cothread in `list` ready in it's order, leaving it empty. Waiters in a timed wait have their timeout cancelled.
+static inline void internal_list_make_ready(co_list_t *list) {
+#if LIBMICROKITCO_NUM_PRIORITIES == 1
+    // Every waiter goes to the one scheduling queue, so after updating each waiter move the whole list across in one splice.
+    for (microkit_cothread_ref_t cur = list->head; cur != LIBMICROKITCO_NULL_HANDLE; cur = co_controller->tcbs[cur].next) {
+        co_controller->tcbs[cur].state = cothread_ready;
+        if (co_controller->tcbs[cur].timer_heap_idx != TIMER_NOT_QUEUED) {
+            internal_timer_heap_remove(cur);
+        }
+    }
+    if (!internal_list_is_empty(list)) {
+        internal_list_splice(&co_controller->scheduling_queues[0], list);
+        co_controller->ready_bitmap = 1;
+    }
+#else
+    microkit_cothread_ref_t waiter;
+    while ((waiter = internal_list_pop(list)) != LIBMICROKITCO_NULL_HANDLE) {
+        if (co_controller->tcbs[waiter].timer_heap_idx != TIMER_NOT_QUEUED) {
+            internal_timer_heap_remove(waiter);
+        }
+        internal_make_ready(waiter);
+    }
+#endif
 }
 
-co_state_t microkit_cothread_query_state(const microkit_cothread_ref_t cothread) {
-    if (cothread >= LIBMICROKITCO_MAX_COTHREADS || cothread < 0) {
-        microkit_cothread_panic(generic_invalid_handle);
+// Whether the caller can switch straight to a cothread it unblocked. A task cannot be switched away from, the woken
+// cothread runs when the task returns. Nor can the root thread dispatching from the event loop, which replies to any
+// PPC before the woken cothreads get to run.
+static inline bool internal_can_handoff(void) {
+#if LIBMICROKITCO_MAX_TASKS
+    if (internal_is_task(co_controller->running)) {
+        return false;
     }
+#endif
+    return !(co_controller->event_loop_running && co_controller->running == LIBMICROKITCO_ROOT_THREAD);
+}
 
-    return co_controller->tcbs[cothread].state;
+// Run a cothread that was just unblocked right away, unless that is deferred, the caller cannot be switched away from
+// or the caller is more urgent. A less urgent cothread waits it's turn like any other ready cothread.
+static inline void internal_wake(const microkit_cothread_ref_t unblocked) {
+#ifdef LIBMICROKITCO_PREEMPTIVE_UNBLOCK
+    internal_make_ready(unblocked);
+#else
+    if (co_controller->tcbs[unblocked].priority >= co_controller->tcbs[co_controller->running].priority && internal_can_handoff()) {
+        internal_handoff(unblocked);
+    } else {
+        internal_make_ready(unblocked);
+    }
+#endif
 }
 
-microkit_cothread_ref_t microkit_cothread_my_handle(void) {
-    return co_controller->running;
+// Like internal_wake() for the first of a batch of unblocked cothreads. It was made ready before the rest of the
+// batch, so if it cannot run right away it still runs before them in their waiting order.
+static inline void internal_wake_queued(const microkit_cothread_ref_t first) {
+#ifndef LIBMICROKITCO_PREEMPTIVE_UNBLOCK
+    if (co_controller->tcbs[first].priority >= co_controller->tcbs[co_controller->running].priority && internal_can_handoff()) {
+        internal_sched_remove(first, co_controller->tcbs[first].priority);
+        internal_handoff(first);
+    }
+#endif
 }
 
-void *microkit_cothread_my_arg(void) {
-    if (co_controller->running == 0) {
-        microkit_cothread_panic(my_arg_called_from_root);
+// Hand out the units in `sem->count` to the waiters at the front of the queue whose request can be met,
+// in FIFO order. Every satisfied waiter is made ready in that order. The first is returned so the caller can
+// decide whether to switch to it with internal_wake_queued(), or LIBMICROKITCO_NULL_HANDLE if none.
+static inline microkit_cothread_ref_t internal_sem_grant(microkit_cothread_sem_t *sem) {
+    microkit_cothread_ref_t first = LIBMICROKITCO_NULL_HANDLE;
+
+    while (!internal_list_is_empty(&sem->waiting) && co_controller->tcbs[sem->waiting.head].wait_n <= sem->count) {
+        sem->count -= co_controller->tcbs[sem->waiting.head].wait_n;
+        const microkit_cothread_ref_t waiter = internal_sem_pop_waiter(sem);
+
+        if (first == LIBMICROKITCO_NULL_HANDLE) {
+            first = waiter;
+        }
+        internal_make_ready(waiter);
     }
 
-    return co_controller->tcbs[co_controller->running].private_arg;
+    return first;
 }
 
-void microkit_cothread_yield(void) {
-    // Caller get pushed onto the appropriate scheduling queue.
-    hosted_queue_t *sched_queue = &co_controller->scheduling_queue;
-    const int sched_err = hostedqueue_push(sched_queue, co_controller->scheduling_queue_mem, &co_controller->running);
-    if (sched_err != LIBHOSTEDQUEUE_NOERR) {
-        microkit_cothread_panic(yield_cannot_schedule_caller);
+// Add `n` units to the semaphore and give them to waiters, anything left over is capped at `max_count`.
+static inline microkit_cothread_ref_t internal_sem_release(microkit_cothread_sem_t *sem, const unsigned int n) {
+    if (internal_list_is_empty(&sem->waiting)) {
+        // Fast path: nobody to wake, just bank the units.
+        sem->count = n >= sem->max_count - sem->count ? sem->max_count : sem->count + n;
+        return LIBMICROKITCO_NULL_HANDLE;
     }
 
-    co_controller->tcbs[co_controller->running].state = cothread_ready;
+    // Waiters present means count is below max_count, and each waiter asks for at most max_count,
+    // so this cannot overflow in any way that matters.
+    sem->count = n > UINT_MAX - sem->count ? UINT_MAX : sem->count + n;
+    const microkit_cothread_ref_t first = internal_sem_grant(sem);
+    if (sem->count > sem->max_count) {
+        sem->count = sem->max_count;
+    }
+    return first;
+}
 
-    // If the scheduling queues are empty beforehand, the caller just get runned again.
-    internal_go_next();
+// Only mark the unblocked cothreads ready, the caller keeps running. The waiters are picked up by
+// the next scheduling round so many wakeups can be batched before any switch happens.
+static inline void internal_sem_signal_deferred(microkit_cothread_sem_t *sem, const unsigned int n) {
+    internal_sem_release(sem, n);
 }
 
-void microkit_cothread_destroy(const microkit_cothread_ref_t cothread) {
-    if (cothread >= LIBMICROKITCO_MAX_COTHREADS || cothread < 0) {
-        microkit_cothread_panic(generic_invalid_handle);
-    }
+void microkit_cothread_semaphore_init(microkit_cothread_sem_t *ret_sem) {
+    microkit_cothread_semaphore_init_counting(ret_sem, 0, 1);
+}
 
-    if (co_controller->tcbs[cothread].state == cothread_not_active) {
-        microkit_cothread_panic(destroy_already_not_initialised);
+void microkit_cothread_semaphore_init_counting(microkit_cothread_sem_t *ret_sem, const unsigned int initial, const unsigned int max_count) {
+    if (max_count == 0 || initial > max_count) {
+        microkit_cothread_panic(sem_init_invalid_count);
     }
 
-    if (co_controller->running == 0) {
-        // cannot destroy root thread
-        microkit_cothread_panic(destroy_cannot_destroy_root);
+    ret_sem->waiting.head = LIBMICROKITCO_NULL_HANDLE;
+    ret_sem->waiting.tail = LIBMICROKITCO_NULL_HANDLE;
+    ret_sem->count = initial;
+    ret_sem->max_count = max_count;
+}
+
+void microkit_cothread_semaphore_wait(microkit_cothread_sem_t *sem) {
+    microkit_cothread_semaphore_wait_n(sem, 1);
+}
+
+void microkit_cothread_semaphore_wait_n(microkit_cothread_sem_t *sem, const unsigned int n) {
+    if (n == 0 || n > sem->max_count) {
+        // Can never be satisfied as the count is capped at max_count.
+        microkit_cothread_panic(sem_wait_invalid_count);
     }
+    internal_check_can_block();
 
-    if (hostedqueue_push(&co_controller->free_handle_queue, co_controller->free_handle_queue_mem, &cothread) != LIBHOSTEDQUEUE_NOERR) {
-        microkit_cothread_panic(destroy_cannot_release_handle);
+    // Waiters are served in FIFO order, so only take the units directly if nobody is queued before us.
+    if (sem->count >= n && internal_list_is_empty(&sem->waiting)) {
+        sem->count -= n;
     } else {
-        co_controller->tcbs[cothread].state = cothread_not_active;
-        if (cothread == co_controller->running) {
-            internal_go_next();
+        co_controller->tcbs[co_controller->running].wait_n = n;
+        internal_block_on(&sem->waiting, sem);
+        internal_go_next();
+    }
+}
+
+void microkit_cothread_semaphore_signal(microkit_cothread_sem_t *sem) {
+    // Fast path: nobody to wake, so only the count changes and the caller keeps running.
+    if (internal_list_is_empty(&sem->waiting)) {
+        if (sem->count < sem->max_count) {
+            sem->count += 1;
         }
+        return;
     }
+
+    microkit_cothread_semaphore_signal_n(sem, 1);
 }
 
-void microkit_cothread_wait_on_channel(const microkit_channel wake_on) {
-    if (wake_on >= MICROKIT_MAX_CHANNELS) {
-        microkit_cothread_panic(wait_on_channel_invalid_channel);
+void microkit_cothread_semaphore_signal_n(microkit_cothread_sem_t *sem, const unsigned int n) {
+    const microkit_cothread_ref_t head = internal_sem_release(sem, n);
+    if (head != LIBMICROKITCO_NULL_HANDLE) {
+        internal_wake_queued(head);
     }
+}
 
-    microkit_cothread_semaphore_wait(&co_controller->blocked_channel_map[wake_on]);
+void microkit_cothread_semaphore_broadcast(microkit_cothread_sem_t *sem) {
+    if (internal_list_is_empty(&sem->waiting)) {
+        internal_sem_release(sem, 1);
+        return;
+    }
+
+    // Every waiter is released whatever it asked for and the count is left alone. The first runs right away
+    // and the rest are already queued ahead of the caller, so the whole batch runs in one scheduling round.
+    const microkit_cothread_ref_t head = sem->waiting.head;
+    internal_list_make_ready(&sem->waiting);
+    internal_wake_queued(head);
 }
 
-void microkit_cothread_recv_ntfn(const microkit_channel ch) {
-    if (co_controller->running != LIBMICROKITCO_ROOT_THREAD) {
-        microkit_cothread_panic(recv_ntfn_called_from_non_root_cothread);
+void microkit_cothread_semaphore_signal_deferred(microkit_cothread_sem_t *sem) {
+    internal_sem_signal_deferred(sem, 1);
+}
+
+bool microkit_cothread_semaphore_is_queue_empty(const microkit_cothread_sem_t *sem) {
+    return internal_list_is_empty(&sem->waiting);
+}
+
+bool microkit_cothread_semaphore_is_set(const microkit_cothread_sem_t *sem) {
+    return sem->count > 0;
+}
+
+// =========== Mutexes ===========
+
+#if LIBMICROKITCO_NUM_PRIORITIES > 1
+// Highest priority among the cothreads waiting on a mutex, or the lowest priority if none.
+static inline microkit_cothread_prio_t internal_mutex_waiters_prio(const microkit_cothread_mutex_t *mutex) {
+    microkit_cothread_prio_t prio = 0;
+    for (microkit_cothread_ref_t cur = mutex->waiting.head; cur != LIBMICROKITCO_NULL_HANDLE; cur = co_controller->tcbs[cur].next) {
+        if (co_controller->tcbs[cur].priority > prio) {
+            prio = co_controller->tcbs[cur].priority;
+        }
     }
-    if (ch >= MICROKIT_MAX_CHANNELS) {
-        microkit_cothread_panic(recv_ntfn_invalid_channel);
+    return prio;
+}
+
+// The priority a cothread must run at: it's own, or that of the most urgent waiter on any mutex it holds.
+static microkit_cothread_prio_t internal_effective_prio(const microkit_cothread_ref_t cothread) {
+    const co_tcb_t *tcb = &co_controller->tcbs[cothread];
+    microkit_cothread_prio_t prio = tcb->base_priority;
+    for (const microkit_cothread_mutex_t *held = tcb->held_mutexes; held != NULL; held = held->next_held) {
+        const microkit_cothread_prio_t waiters_prio = internal_mutex_waiters_prio(held);
+        if (waiters_prio > prio) {
+            prio = waiters_prio;
+        }
+    }
+    return prio;
+}
+
+// Lend `prio` to the owner of `mutex`, then on down the chain while that owner is itself waiting on a mutex.
+static void internal_mutex_boost(microkit_cothread_mutex_t *mutex, const microkit_cothread_prio_t prio) {
+    while (mutex != NULL && mutex->owner != LIBMICROKITCO_NULL_HANDLE) {
+        const microkit_cothread_ref_t owner = mutex->owner;
+        if (co_controller->tcbs[owner].priority >= prio) {
+            break;
+        }
+        internal_change_prio(owner, prio);
+        mutex = co_controller->tcbs[owner].blocked_on_mutex;
     }
+}
 
-    microkit_cothread_semaphore_signal(&co_controller->blocked_channel_map[ch]);
+// A waiter left `mutex` without getting it, take back what it lent the owner and on down the chain.
+static void internal_mutex_unboost(microkit_cothread_mutex_t *mutex) {
+    while (mutex != NULL && mutex->owner != LIBMICROKITCO_NULL_HANDLE) {
+        const microkit_cothread_ref_t owner = mutex->owner;
+        const microkit_cothread_prio_t prio = internal_effective_prio(owner);
+        if (co_controller->tcbs[owner].priority == prio) {
+            break;
+        }
+        internal_change_prio(owner, prio);
+        mutex = co_controller->tcbs[owner].blocked_on_mutex;
+    }
+}
+#endif
+
+static inline void internal_mutex_take(microkit_cothread_mutex_t *mutex, const microkit_cothread_ref_t cothread) {
+    mutex->owner = cothread;
+    mutex->next_held = co_controller->tcbs[cothread].held_mutexes;
+    co_controller->tcbs[cothread].held_mutexes = mutex;
+}
+
+// Take the cothread that gets the mutex next off it's waiting queue.
+static inline microkit_cothread_ref_t internal_mutex_pop_waiter(microkit_cothread_mutex_t *mutex) {
+#if LIBMICROKITCO_NUM_PRIORITIES > 1
+    microkit_cothread_ref_t chosen = mutex->waiting.head;
+    for (microkit_cothread_ref_t cur = co_controller->tcbs[chosen].next; cur != LIBMICROKITCO_NULL_HANDLE; cur = co_controller->tcbs[cur].next) {
+        if (co_controller->tcbs[cur].priority > co_controller->tcbs[chosen].priority) {
+            chosen = cur;
+        }
+    }
+    internal_list_remove(&mutex->waiting, chosen);
+    co_controller->tcbs[chosen].blocked_on_mutex = NULL;
+    return chosen;
+#else
+    return internal_list_pop(&mutex->waiting);
+#endif
+}
+
+void microkit_cothread_mutex_init(microkit_cothread_mutex_t *ret_mutex) {
+    ret_mutex->owner = LIBMICROKITCO_NULL_HANDLE;
+    ret_mutex->waiting.head = LIBMICROKITCO_NULL_HANDLE;
+    ret_mutex->waiting.tail = LIBMICROKITCO_NULL_HANDLE;
+    ret_mutex->next_held = NULL;
+}
+
+void microkit_cothread_mutex_lock(microkit_cothread_mutex_t *mutex) {
+    const microkit_cothread_ref_t running = co_controller->running;
+    internal_check_can_block();
+
+    // Fast path: uncontended, nothing to schedule.
+    if (mutex->owner == LIBMICROKITCO_NULL_HANDLE) {
+        internal_mutex_take(mutex, running);
+        return;
+    }
+    if (mutex->owner == running) {
+        microkit_cothread_panic(mutex_lock_recursive);
+    }
+    // The root thread must stay available to receive notifications.
+    if (running == LIBMICROKITCO_ROOT_THREAD) {
+        microkit_cothread_panic(mutex_lock_called_from_root);
+    }
+
+    internal_block_on(&mutex->waiting, NULL);
+#if LIBMICROKITCO_NUM_PRIORITIES > 1
+    // Make sure whoever we are waiting on is not held up by anything less urgent than us.
+    co_controller->tcbs[running].blocked_on_mutex = mutex;
+    internal_mutex_boost(mutex, co_controller->tcbs[running].priority);
+#endif
+
+    // The mutex is ours once we are woken up, unlock() hands it over directly.
+    internal_go_next();
+}
+
+bool microkit_cothread_mutex_trylock(microkit_cothread_mutex_t *mutex) {
+    if (mutex->owner != LIBMICROKITCO_NULL_HANDLE) {
+        return false;
+    }
+
+    internal_mutex_take(mutex, co_controller->running);
+    return true;
+}
+
+// Unlock a mutex held by `owner` and hand it to the next waiter, which is returned without being scheduled,
+// or LIBMICROKITCO_NULL_HANDLE if nobody was waiting.
+static microkit_cothread_ref_t internal_mutex_release(microkit_cothread_mutex_t *mutex, const microkit_cothread_ref_t owner) {
+    // Mutexes are usually unlocked in the reverse order they were locked, so this is normally the head.
+    microkit_cothread_mutex_t **link = &co_controller->tcbs[owner].held_mutexes;
+    while (*link != mutex) {
+        link = &(*link)->next_held;
+    }
+    *link = mutex->next_held;
+    mutex->next_held = NULL;
+
+    // Fast path: uncontended, nobody can have lent us their priority through this mutex either.
+    if (internal_list_is_empty(&mutex->waiting)) {
+        mutex->owner = LIBMICROKITCO_NULL_HANDLE;
+        return LIBMICROKITCO_NULL_HANDLE;
+    }
+
+    const microkit_cothread_ref_t new_owner = internal_mutex_pop_waiter(mutex);
+    internal_mutex_take(mutex, new_owner);
+#if LIBMICROKITCO_NUM_PRIORITIES > 1
+    // Give back what we inherited through this mutex, the waiters left behind now lend it to the new owner.
+    internal_change_prio(owner, internal_effective_prio(owner));
+    internal_mutex_boost(mutex, internal_mutex_waiters_prio(mutex));
+#endif
+
+    return new_owner;
+}
+
+void microkit_cothread_mutex_unlock(microkit_cothread_mutex_t *mutex) {
+    const microkit_cothread_ref_t running = co_controller->running;
+    if (mutex->owner != running) {
+        microkit_cothread_panic(mutex_unlock_not_owner);
+    }
+
+    const microkit_cothread_ref_t new_owner = internal_mutex_release(mutex, running);
+    if (new_owner == LIBMICROKITCO_NULL_HANDLE) {
+        return;
+    }
+
+#ifndef LIBMICROKITCO_PREEMPTIVE_UNBLOCK
+    // Only switch if the new owner is more urgent, otherwise it waits it's turn like any other ready cothread.
+    if (co_controller->tcbs[new_owner].priority > co_controller->tcbs[running].priority && internal_can_handoff()) {
+        internal_handoff(new_owner);
+        return;
+    }
+#endif
+    internal_make_ready(new_owner);
+}
+
+microkit_cothread_ref_t microkit_cothread_mutex_owner(const microkit_cothread_mutex_t *mutex) {
+    return mutex->owner;
+}
+
+// =========== Condition variables ===========
+
+void microkit_cothread_cond_init(microkit_cothread_cond_t *ret_cond) {
+    ret_cond->waiting.head = LIBMICROKITCO_NULL_HANDLE;
+    ret_cond->waiting.tail = LIBMICROKITCO_NULL_HANDLE;
+}
+
+void microkit_cothread_cond_wait(microkit_cothread_cond_t *cond, microkit_cothread_mutex_t *mutex) {
+    const microkit_cothread_ref_t running = co_controller->running;
+    if (mutex->owner != running) {
+        microkit_cothread_panic(cond_wait_mutex_not_owned);
+    }
+    // The root thread must stay available to receive notifications.
+    if (running == LIBMICROKITCO_ROOT_THREAD) {
+        microkit_cothread_panic(cond_wait_called_from_root);
+    }
+    internal_check_can_block();
+
+    // Nothing can run between releasing the mutex and blocking, so no signal can be missed.
+    const microkit_cothread_ref_t new_owner = internal_mutex_release(mutex, running);
+    if (new_owner != LIBMICROKITCO_NULL_HANDLE) {
+        internal_make_ready(new_owner);
+    }
+
+    internal_block_on(&cond->waiting, NULL);
+    internal_go_next();
+
+    microkit_cothread_mutex_lock(mutex);
+}
+
+void microkit_cothread_cond_signal(microkit_cothread_cond_t *cond) {
+    // The waiter needs the mutex the caller normally holds, so there is no point switching to it now.
+    const microkit_cothread_ref_t waiter = internal_list_pop(&cond->waiting);
+    if (waiter != LIBMICROKITCO_NULL_HANDLE) {
+        internal_make_ready(waiter);
+    }
+}
+
+void microkit_cothread_cond_broadcast(microkit_cothread_cond_t *cond) {
+    if (internal_list_is_empty(&cond->waiting)) {
+        return;
+    }
+
+    internal_list_make_ready(&cond->waiting);
+}
+
+// =========== Channels ===========
+
+// Add an item to the channel without blocking. A receiver waiting on the empty channel takes it directly and is
+// returned without being scheduled.
+static co_chan_result_t internal_chan_put(microkit_cothread_chan_t *chan, const void *item, microkit_cothread_ref_t *ret_unblocked) {
+    *ret_unblocked = LIBMICROKITCO_NULL_HANDLE;
+    if (chan->closed) {
+        return co_chan_closed;
+    }
+
+    if (!internal_list_is_empty(&chan->receivers)) {
+        const microkit_cothread_ref_t receiver = internal_list_pop(&chan->receivers);
+        hostedqueue_copy_item(internal_blocked_addr(receiver, co_controller->tcbs[receiver].chan_item), item, chan->queue.item_size);
+        co_controller->tcbs[receiver].chan_result = co_chan_ok;
+        *ret_unblocked = receiver;
+        return co_chan_ok;
+    }
+
+    if (hostedqueue_push(&chan->queue, chan->buffer, item) != LIBHOSTEDQUEUE_NOERR) {
+        return co_chan_would_block;
+    }
+    return co_chan_ok;
+}
+
+// Take an item from the channel without blocking. A sender waiting on the full channel gets it's item into the
+// space just made and is returned without being scheduled.
+static co_chan_result_t internal_chan_get(microkit_cothread_chan_t *chan, void *ret_item, microkit_cothread_ref_t *ret_unblocked) {
+    *ret_unblocked = LIBMICROKITCO_NULL_HANDLE;
+    if (hostedqueue_pop(&chan->queue, chan->buffer, ret_item) != LIBHOSTEDQUEUE_NOERR) {
+        // A closed channel still hands out what was sent before it was closed.
+        return chan->closed ? co_chan_closed : co_chan_would_block;
+    }
+
+    if (!internal_list_is_empty(&chan->senders)) {
+        const microkit_cothread_ref_t sender = internal_list_pop(&chan->senders);
+        hostedqueue_push(&chan->queue, chan->buffer, internal_blocked_addr(sender, co_controller->tcbs[sender].chan_item));
+        co_controller->tcbs[sender].chan_result = co_chan_ok;
+        *ret_unblocked = sender;
+    }
+    return co_chan_ok;
+}
+
+// Block the caller on one side of a channel until the other side or close() finishes the operation for it.
+static co_chan_result_t internal_chan_block(co_list_t *waiting, void *item) {
+    // The root thread must stay available to receive notifications, it can use the try_* variants.
+    if (co_controller->running == LIBMICROKITCO_ROOT_THREAD) {
+        microkit_cothread_panic(chan_block_called_from_root);
+    }
+
+    co_tcb_t *tcb = &co_controller->tcbs[co_controller->running];
+    tcb->chan_item = item;
+    internal_block_on(waiting, NULL);
+    internal_go_next();
+    return tcb->chan_result;
+}
+
+void microkit_cothread_chan_init(microkit_cothread_chan_t *ret_chan, void *buffer, const unsigned capacity, const size_t item_size) {
+    if (buffer == NULL || hostedqueue_init(&ret_chan->queue, capacity, item_size) != LIBHOSTEDQUEUE_NOERR) {
+        microkit_cothread_panic(chan_init_invalid_args);
+    }
+
+    ret_chan->buffer = buffer;
+    ret_chan->closed = false;
+    ret_chan->senders.head = LIBMICROKITCO_NULL_HANDLE;
+    ret_chan->senders.tail = LIBMICROKITCO_NULL_HANDLE;
+    ret_chan->receivers.head = LIBMICROKITCO_NULL_HANDLE;
+    ret_chan->receivers.tail = LIBMICROKITCO_NULL_HANDLE;
+}
+
+co_chan_result_t microkit_cothread_chan_send(microkit_cothread_chan_t *chan, const void *item) {
+    internal_check_can_block();
+
+    microkit_cothread_ref_t unblocked;
+    const co_chan_result_t result = internal_chan_put(chan, item, &unblocked);
+    if (result == co_chan_would_block) {
+        // Back-pressure: wait for a receiver to make space, it copies our item in for us.
+        return internal_chan_block(&chan->senders, (void *) item);
+    }
+
+    if (unblocked != LIBMICROKITCO_NULL_HANDLE) {
+        // The receiver already has the item, let it get on with it.
+        internal_wake(unblocked);
+    }
+    return result;
+}
+
+co_chan_result_t microkit_cothread_chan_recv(microkit_cothread_chan_t *chan, void *ret_item) {
+    internal_check_can_block();
+
+    microkit_cothread_ref_t unblocked;
+    const co_chan_result_t result = internal_chan_get(chan, ret_item, &unblocked);
+    if (result == co_chan_would_block) {
+        return internal_chan_block(&chan->receivers, ret_item);
+    }
+
+    if (unblocked != LIBMICROKITCO_NULL_HANDLE) {
+        internal_make_ready(unblocked);
+    }
+    return result;
+}
+
+co_chan_result_t microkit_cothread_chan_try_send(microkit_cothread_chan_t *chan, const void *item) {
+    microkit_cothread_ref_t unblocked;
+    const co_chan_result_t result = internal_chan_put(chan, item, &unblocked);
+    if (unblocked != LIBMICROKITCO_NULL_HANDLE) {
+        internal_make_ready(unblocked);
+    }
+    return result;
+}
+
+co_chan_result_t microkit_cothread_chan_try_recv(microkit_cothread_chan_t *chan, void *ret_item) {
+    microkit_cothread_ref_t unblocked;
+    const co_chan_result_t result = internal_chan_get(chan, ret_item, &unblocked);
+    if (unblocked != LIBMICROKITCO_NULL_HANDLE) {
+        internal_make_ready(unblocked);
+    }
+    return result;
+}
+
+void microkit_cothread_chan_close(microkit_cothread_chan_t *chan) {
+    chan->closed = true;
+
+    // Receivers only wait on an empty channel so there is nothing left for them, and senders' items are dropped.
+    microkit_cothread_ref_t waiter;
+    while ((waiter = internal_list_pop(&chan->receivers)) != LIBMICROKITCO_NULL_HANDLE) {
+        co_controller->tcbs[waiter].chan_result = co_chan_closed;
+        internal_make_ready(waiter);
+    }
+    while ((waiter = internal_list_pop(&chan->senders)) != LIBMICROKITCO_NULL_HANDLE) {
+        co_controller->tcbs[waiter].chan_result = co_chan_closed;
+        internal_make_ready(waiter);
+    }
+}
+
+// =========== Worker pools ===========
+
+static void internal_pool_worker(void) {
+    microkit_cothread_pool_t *pool = microkit_cothread_my_arg();
+
+    // Blocks on the ring while it is empty, and returns once the pool is shut down and the ring drained.
+    microkit_cothread_pool_work_t work;
+    while (microkit_cothread_chan_recv(&pool->ring, &work) == co_chan_ok) {
+        work.fn(work.arg);
+    }
+}
+
+int microkit_cothread_pool_init(microkit_cothread_pool_t *ret_pool, microkit_cothread_pool_work_t *ring, const unsigned capacity, const int num_workers) {
+    if (num_workers < 1) {
+        microkit_cothread_panic(pool_init_invalid_args);
+    }
+    microkit_cothread_chan_init(&ret_pool->ring, ring, capacity, sizeof(microkit_cothread_pool_work_t));
+
+    int spawned = 0;
+    while (spawned < num_workers && microkit_cothread_spawn(internal_pool_worker, ret_pool) != LIBMICROKITCO_NULL_HANDLE) {
+        spawned++;
+    }
+    return spawned;
+}
+
+bool microkit_cothread_pool_submit(microkit_cothread_pool_t *pool, const pool_work_fn_t fn, void *arg) {
+    if (!fn) {
+        microkit_cothread_panic(pool_submit_fn_is_null);
+    }
+
+    // An idle worker is handed the item directly and made ready, the caller keeps running either way.
+    const microkit_cothread_pool_work_t work = { fn, arg };
+    return microkit_cothread_chan_try_send(&pool->ring, &work) == co_chan_ok;
+}
+
+void microkit_cothread_pool_shutdown(microkit_cothread_pool_t *pool) {
+    microkit_cothread_chan_close(&pool->ring);
+}
+
+// =========== Futures ===========
+
+// Whether the futures a cothread is blocked on in `future_await_all()` or `future_await_any()` let it continue.
+// The array, and the futures, are usually on the cothread's stack, which may be in it's save buffer by now.
+static inline bool internal_future_satisfied(const microkit_cothread_ref_t cothread) {
+    const co_tcb_t *tcb = &co_controller->tcbs[cothread];
+    microkit_cothread_future_t *const *futures = internal_blocked_addr(cothread, tcb->awaiting);
+    for (int i = 0; i < tcb->awaiting_n; i++) {
+        const microkit_cothread_future_t *future = internal_blocked_addr(cothread, futures[i]);
+        const bool completed = future->completed;
+        if (tcb->awaiting_all && !completed) {
+            return false;
+        }
+        if (!tcb->awaiting_all && completed) {
+            return true;
+        }
+    }
+    return tcb->awaiting_all;
+}
+
+static inline void internal_future_check_caller(void) {
+    // The root thread must stay available to receive the notifications that complete futures.
+    if (co_controller->running == LIBMICROKITCO_ROOT_THREAD) {
+        microkit_cothread_panic(future_await_called_from_root);
+    }
+    internal_check_can_block();
+}
+
+// Block the caller on a set of futures until they are all, or any of them is, completed.
+static inline void internal_future_await_set(microkit_cothread_future_t *const *futures, const int n, const bool all) {
+    if (!futures || n < 1) {
+        microkit_cothread_panic(future_await_invalid_args);
+    }
+
+    co_tcb_t *tcb = &co_controller->tcbs[co_controller->running];
+    tcb->awaiting = futures;
+    tcb->awaiting_n = n;
+    tcb->awaiting_all = all;
+    if (internal_future_satisfied(co_controller->running)) {
+        return;
+    }
+
+    internal_future_check_caller();
+    internal_block_on(&co_controller->future_waiters, NULL);
+    internal_go_next();
+}
+
+void microkit_cothread_future_init(microkit_cothread_future_t *ret_future) {
+    ret_future->completed = false;
+    ret_future->value = NULL;
+    ret_future->waiting.head = LIBMICROKITCO_NULL_HANDLE;
+    ret_future->waiting.tail = LIBMICROKITCO_NULL_HANDLE;
+}
+
+void microkit_cothread_future_complete(microkit_cothread_future_t *future, void *value) {
+    if (future->completed) {
+        microkit_cothread_panic(future_already_completed);
+    }
+    future->value = value;
+    future->completed = true;
+
+    microkit_cothread_ref_t first = future->waiting.head;
+    internal_list_make_ready(&future->waiting);
+
+    // A set waiter was not satisfied before this completion, so if it is now this future must be one of it's own.
+    microkit_cothread_ref_t cur = co_controller->future_waiters.head;
+    while (cur != LIBMICROKITCO_NULL_HANDLE) {
+        const microkit_cothread_ref_t next = co_controller->tcbs[cur].next;
+        if (internal_future_satisfied(cur)) {
+            internal_list_remove(&co_controller->future_waiters, cur);
+            if (first == LIBMICROKITCO_NULL_HANDLE) {
+                first = cur;
+            }
+            internal_make_ready(cur);
+        }
+        cur = next;
+    }
+
+    if (first != LIBMICROKITCO_NULL_HANDLE) {
+        internal_wake_queued(first);
+    }
+}
+
+bool microkit_cothread_future_is_complete(const microkit_cothread_future_t *future) {
+    return future->completed;
+}
+
+void *microkit_cothread_future_await(microkit_cothread_future_t *future) {
+    if (!future->completed) {
+        internal_future_check_caller();
+        internal_block_on(&future->waiting, NULL);
+        internal_go_next();
+    }
+    return future->value;
+}
+
+void microkit_cothread_future_await_all(microkit_cothread_future_t *const *futures, const int n) {
+    internal_future_await_set(futures, n, true);
+}
+
+int microkit_cothread_future_await_any(microkit_cothread_future_t *const *futures, const int n) {
+    internal_future_await_set(futures, n, false);
+
+    int i = 0;
+    while (!futures[i]->completed) {
+        i++;
+    }
+    return i;
+}
+
+// =========== Timers ===========
+
+static inline void internal_timer_heap_place(const int idx, const microkit_cothread_ref_t cothread) {
+    co_controller->timer_heap[idx] = cothread;
+    co_controller->tcbs[cothread].timer_heap_idx = idx;
+}
+
+static inline microkit_cothread_time_t internal_timer_heap_key(const int idx) {
+    return co_controller->tcbs[co_controller->timer_heap[idx]].deadline;
+}
+
+static inline void internal_timer_heap_sift_up(int idx) {
+    const microkit_cothread_ref_t cothread = co_controller->timer_heap[idx];
+    const microkit_cothread_time_t deadline = co_controller->tcbs[cothread].deadline;
+
+    while (idx > 0) {
+        const int parent = (idx - 1) / 2;
+        if (internal_timer_heap_key(parent) <= deadline) {
+            break;
+        }
+        internal_timer_heap_place(idx, co_controller->timer_heap[parent]);
+        idx = parent;
+    }
+    internal_timer_heap_place(idx, cothread);
+}
+
+static inline void internal_timer_heap_sift_down(int idx) {
+    const microkit_cothread_ref_t cothread = co_controller->timer_heap[idx];
+    const microkit_cothread_time_t deadline = co_controller->tcbs[cothread].deadline;
+    const int size = co_controller->timer_heap_size;
+
+    while (true) {
+        int child = 2 * idx + 1;
+        if (child >= size) {
+            break;
+        }
+        if (child + 1 < size && internal_timer_heap_key(child + 1) < internal_timer_heap_key(child)) {
+            child += 1;
+        }
+        if (deadline <= internal_timer_heap_key(child)) {
+            break;
+        }
+        internal_timer_heap_place(idx, co_controller->timer_heap[child]);
+        idx = child;
+    }
+    internal_timer_heap_place(idx, cothread);
+}
+
+static inline void internal_timer_heap_insert(const microkit_cothread_ref_t cothread) {
+    const int idx = co_controller->timer_heap_size;
+    co_controller->timer_heap_size += 1;
+    internal_timer_heap_place(idx, cothread);
+    internal_timer_heap_sift_up(idx);
+}
+
+static inline void internal_timer_heap_remove(const microkit_cothread_ref_t cothread) {
+    const int idx = co_controller->tcbs[cothread].timer_heap_idx;
+    co_controller->timer_heap_size -= 1;
+    co_controller->tcbs[cothread].timer_heap_idx = TIMER_NOT_QUEUED;
+
+    // Fill the hole with the last item then restore the heap property in whichever direction is needed.
+    if (idx != co_controller->timer_heap_size) {
+        const microkit_cothread_ref_t last = co_controller->timer_heap[co_controller->timer_heap_size];
+        internal_timer_heap_place(idx, last);
+        internal_timer_heap_sift_down(idx);
+        internal_timer_heap_sift_up(co_controller->tcbs[last].timer_heap_idx);
+    }
+}
+
+// Make every cothread whose deadline has passed ready, then ask for a notification at the next deadline.
+// Returns whether any cothread was woken.
+static bool internal_timer_expire(void) {
+    const microkit_cothread_time_t now = co_controller->timer_now();
+    bool woken = false;
+
+    while (co_controller->timer_heap_size && internal_timer_heap_key(0) <= now) {
+        const microkit_cothread_ref_t cothread = co_controller->timer_heap[0];
+        co_tcb_t *tcb = &co_controller->tcbs[cothread];
+
+        internal_timer_heap_remove(cothread);
+        if (tcb->timed_wait_on) {
+            internal_list_remove(&tcb->timed_wait_on->waiting, cothread);
+
+            // If this waiter asked for more units than available, it may have been holding back the ones behind it.
+            internal_sem_grant(tcb->timed_wait_on);
+        }
+
+        tcb->wait_result = co_wait_timed_out;
+        internal_make_ready(cothread);
+        woken = true;
+    }
+
+    if (co_controller->timer_heap_size) {
+        co_controller->timer_set_timeout(internal_timer_heap_key(0));
+    }
+
+    return woken;
+}
+
+// Block the caller until it's deadline, or until `sem` is signalled if given, whichever comes first.
+static co_wait_result_t internal_timed_block(microkit_cothread_sem_t *sem, const microkit_cothread_time_t deadline) {
+    // The root thread must stay available to receive the timer notification.
+    if (co_controller->running == LIBMICROKITCO_ROOT_THREAD) {
+        microkit_cothread_panic(timed_wait_called_from_root);
+    }
+    internal_check_can_block();
+
+    co_tcb_t *tcb = &co_controller->tcbs[co_controller->running];
+
+    tcb->deadline = deadline;
+    tcb->wait_n = 1;
+    tcb->timed_wait_on = sem;
+    tcb->wait_result = co_wait_signalled;
+    internal_block_on(sem ? &sem->waiting : NULL, sem);
+
+    // Only reprogram the timer when this is the new earliest deadline. Timeouts of cancelled waits are
+    // left to fire spuriously, internal_timer_expire() then finds nothing due and moves on.
+    internal_timer_heap_insert(co_controller->running);
+    if (co_controller->timer_heap[0] == co_controller->running) {
+        co_controller->timer_set_timeout(deadline);
+    }
+
+    internal_go_next();
+
+    tcb->timed_wait_on = NULL;
+    return tcb->wait_result;
+}
+
+static inline void internal_timer_check_caller(void) {
+    if (!co_controller->timer_initialised) {
+        microkit_cothread_panic(timer_not_initialised);
+    }
+}
+
+void microkit_cothread_timer_init(const microkit_channel timer_ch, const co_timer_now_t now, const co_timer_set_timeout_t set_timeout) {
+    if (co_controller->timer_initialised) {
+        microkit_cothread_panic(timer_init_already_initialised);
+    }
+    if (timer_ch >= MICROKIT_MAX_CHANNELS || !now || !set_timeout) {
+        microkit_cothread_panic(timer_init_invalid_args);
+    }
+
+    co_controller->timer_channel = timer_ch;
+    co_controller->timer_now = now;
+    co_controller->timer_set_timeout = set_timeout;
+    co_controller->timer_heap_size = 0;
+    co_controller->timer_initialised = true;
+}
+
+void microkit_cothread_sleep(const microkit_cothread_time_t duration) {
+    internal_timer_check_caller();
+    microkit_cothread_sleep_until(co_controller->timer_now() + duration);
+}
+
+void microkit_cothread_sleep_until(const microkit_cothread_time_t deadline) {
+    internal_timer_check_caller();
+    if (deadline <= co_controller->timer_now()) {
+        return;
+    }
+
+    internal_timed_block(NULL, deadline);
+}
+
+co_wait_result_t microkit_cothread_semaphore_wait_timeout(microkit_cothread_sem_t *sem, const microkit_cothread_time_t timeout) {
+    internal_timer_check_caller();
+    if (sem->count && internal_list_is_empty(&sem->waiting)) {
+        sem->count -= 1;
+        return co_wait_signalled;
+    }
+    if (timeout == 0) {
+        return co_wait_timed_out;
+    }
+
+    return internal_timed_block(sem, co_controller->timer_now() + timeout);
+}
+
+co_wait_result_t microkit_cothread_wait_on_channel_timeout(const microkit_channel wake_on, const microkit_cothread_time_t timeout) {
+    if (wake_on >= MICROKIT_MAX_CHANNELS) {
+        microkit_cothread_panic(wait_on_channel_invalid_channel);
+    }
+
+    return microkit_cothread_semaphore_wait_timeout(&co_controller->blocked_channel_map[wake_on], timeout);
+}
+
+// =========== Public functions ===========
+
+// Set up the controller in the given memory for the root thread plus `num_stacks` cothreads, with no co-stacks yet.
+static void internal_init_controller(co_control_t *controller_memory_addr, const int num_stacks) {
+#ifdef LIBMICROKITCO_MAX_COTHREADS
+    if (num_stacks != LIBMICROKITCO_MAX_COTHREADS - 1) {
+        microkit_cothread_panic(init_num_costacks_not_equal_defined);
+    }
+
+    // This part will VMFault on write if the given memory is not large enough.
+    memzero((void *) controller_memory_addr, LIBMICROKITCO_CONTROLLER_SIZE);
+    co_controller = controller_memory_addr;
+#else
+    // The arrays follow the controller in the order of their alignment, so no padding is needed between them.
+    const int max_cothreads = num_stacks + 1;
+    memzero((void *) controller_memory_addr, microkit_cothread_controller_size(max_cothreads));
+    co_controller = controller_memory_addr;
+    co_controller->max_cothreads = max_cothreads;
+    co_controller->tcbs = (co_tcb_t *) (co_controller + 1);
+    co_controller->stack_class_size = (size_t *) (co_controller->tcbs + NUM_HANDLES);
+    co_controller->free_handles = (co_list_t *) (co_controller->stack_class_size + max_cothreads);
+    co_controller->timer_heap = (microkit_cothread_ref_t *) (co_controller->free_handles + max_cothreads);
+#endif
+
+    // Initialise the root thread's handle;
+    co_controller->tcbs[0].local_storage = NULL;
+    co_controller->tcbs[0].co_handle = co_active();
+    co_controller->tcbs[0].state = cothread_running;
+    co_controller->tcbs[0].priority = LIBMICROKITCO_DEFAULT_PRIORITY;
+#if LIBMICROKITCO_NUM_PRIORITIES > 1
+    co_controller->tcbs[0].base_priority = LIBMICROKITCO_DEFAULT_PRIORITY;
+#endif
+    co_controller->tcbs[0].next = LIBMICROKITCO_NULL_HANDLE;
+    co_controller->tcbs[0].prev = LIBMICROKITCO_NULL_HANDLE;
+    co_controller->tcbs[0].timer_heap_idx = TIMER_NOT_QUEUED;
+#ifdef LIBMICROKITCO_TIME_SLICE
+    co_controller->tcbs[0].time_slice = LIBMICROKITCO_TIME_SLICE;
+    co_controller->slice_end = internal_cycle_count() + LIBMICROKITCO_TIME_SLICE;
+#endif
+    co_controller->running = LIBMICROKITCO_ROOT_THREAD;
+
+    // Initialise the queues
+    for (int i = 0; i < LIBMICROKITCO_NUM_PRIORITIES; i++) {
+        co_controller->scheduling_queues[i].head = LIBMICROKITCO_NULL_HANDLE;
+        co_controller->scheduling_queues[i].tail = LIBMICROKITCO_NULL_HANDLE;
+    }
+    co_controller->ready_bitmap = 0;
+
+    // Initialise the blocked table
+    for (int i = 0; i < MICROKIT_MAX_CHANNELS; i++) {
+        microkit_cothread_semaphore_init(&co_controller->blocked_channel_map[i]);
+        co_controller->channel_waiters[i].head = LIBMICROKITCO_NULL_HANDLE;
+        co_controller->channel_waiters[i].tail = LIBMICROKITCO_NULL_HANDLE;
+    }
+    co_controller->future_waiters.head = LIBMICROKITCO_NULL_HANDLE;
+    co_controller->future_waiters.tail = LIBMICROKITCO_NULL_HANDLE;
+    co_controller->zombie = LIBMICROKITCO_NULL_HANDLE;
+
+#if LIBMICROKITCO_MAX_TASKS
+    co_controller->free_tasks.head = LIBMICROKITCO_NULL_HANDLE;
+    co_controller->free_tasks.tail = LIBMICROKITCO_NULL_HANDLE;
+    for (microkit_cothread_ref_t i = NUM_COTHREADS; i < NUM_HANDLES; i++) {
+        internal_list_append(&co_controller->free_tasks, i);
+    }
+#endif
+}
+
+// Create an empty stack class, classes must be added in ascending stack size.
+static inline void internal_add_stack_class(const int class, const size_t stack_size) {
+    co_controller->num_stack_classes = class + 1;
+    co_controller->stack_class_size[class] = stack_size;
+    co_controller->free_handles[class].head = LIBMICROKITCO_NULL_HANDLE;
+    co_controller->free_handles[class].tail = LIBMICROKITCO_NULL_HANDLE;
+}
+
+// Give a co-stack to a cothread handle and make the handle available to spawn.
+static inline void internal_add_stack(const microkit_cothread_ref_t handle, const int class, void *stack, const size_t stack_size) {
+    co_tcb_t *tcb = &co_controller->tcbs[handle];
+    tcb->local_storage = stack;
+    tcb->stack_size = stack_size;
+    tcb->stack_class = class;
+    internal_list_append(&co_controller->free_handles[class], handle);
+}
+
+static void internal_init(
+    co_control_t *controller_memory_addr,
+    const microkit_cothread_stack_pool_t *pools,
+    const int num_pools,
+    const size_t minimum_stack_size
+) {
+    int total_stacks = 0;
+    for (int i = 0; i < num_pools; i++) {
+        total_stacks += pools[i].count;
+    }
+    if (num_pools < 1 || num_pools > total_stacks) {
+        microkit_cothread_panic(init_num_costacks_not_equal_defined);
+    }
+
+    internal_init_controller(controller_memory_addr, total_stacks);
+
+    // Check that all the stacks are in a valid memory region and hand them out to cothread handles in order.
+    // Skip the zero TCB because its the root thread.
+    microkit_cothread_ref_t handle = 1;
+    for (int class = 0; class < num_pools; class++) {
+        if (pools[class].stack_size < minimum_stack_size) {
+            microkit_cothread_panic(init_stack_too_small);
+        }
+        if (class > 0 && pools[class].stack_size <= pools[class - 1].stack_size) {
+            microkit_cothread_panic(init_stack_pools_not_ascending);
+        }
+
+        internal_add_stack_class(class, pools[class].stack_size);
+        for (int i = 0; i < pools[class].count; i++, handle++) {
+            char *stack = (char *) pools[class].stacks[i];
+            if (stack == NULL) {
+                microkit_cothread_panic(init_co_stack_null);
+            }
+
+            // sanity check the stacks, crash if stack not as big as we think
+            stack[0] = 0;
+            stack[pools[class].stack_size - 1] = 0;
+
+            internal_add_stack(handle, class, stack, pools[class].stack_size);
+        }
+    }
+
+    // Check that none of the stacks overlap
+    for (int i = 1; i < NUM_COTHREADS; i++) {
+        uintptr_t this_stack_start = (uintptr_t) co_controller->tcbs[i].local_storage;
+        uintptr_t this_stack_end = this_stack_start + co_controller->tcbs[i].stack_size - 1;
+
+        for (int j = 1; j < NUM_COTHREADS; j++) {
+            if (j != i) {
+                uintptr_t other_stack_start = (uintptr_t) co_controller->tcbs[j].local_storage;
+                uintptr_t other_stack_end = other_stack_start + co_controller->tcbs[j].stack_size - 1;
+
+                if (this_stack_start <= other_stack_end && other_stack_start <= this_stack_end) {
+                    microkit_cothread_panic(init_co_stack_overlap);
+                }
+            }
+        }
+    }
+}
+
+#ifndef LIBMICROKITCO_SHARED_STACK
+void microkit_cothread_init_arena(
+    co_control_t *controller_memory_addr,
+    const size_t controller_memory_size,
+    void *arena,
+    const size_t arena_size,
+    const size_t stack_size,
+    const size_t stride,
+    const size_t colour_offset
+) {
+    if (co_controller != NULL) {
+        microkit_cothread_panic(init_already_initialised);
+    }
+    if (arena == NULL) {
+        microkit_cothread_panic(init_co_stack_null);
+    }
+    if (stack_size < MINIMUM_STACK_SIZE || stride < stack_size) {
+        microkit_cothread_panic(init_arena_invalid_layout);
+    }
+    if (arena_size < stack_size) {
+        microkit_cothread_panic(init_arena_too_small);
+    }
+
+    // Stacks are laid out back to back `stride` bytes apart, so they cannot overlap and anything in between is never
+    // touched by the library. That gap can be left unmapped in the system description to act as a guard.
+    const size_t stacks_fit = (arena_size - stack_size) / stride + 1;
+#ifdef LIBMICROKITCO_MAX_COTHREADS
+    const int num_stacks = LIBMICROKITCO_MAX_COTHREADS - 1;
+    if (stacks_fit < (size_t) num_stacks) {
+        microkit_cothread_panic(init_arena_too_small);
+    }
+    if (controller_memory_size < LIBMICROKITCO_CONTROLLER_SIZE) {
+        microkit_cothread_panic(init_controller_too_small);
+    }
+#else
+    const int num_stacks = stacks_fit;
+    // Every stack in the arena gets a TCB, so a large arena needs a large controller.
+    if (controller_memory_size < microkit_cothread_controller_size(num_stacks + 1)) {
+        microkit_cothread_panic(init_controller_too_small);
+    }
+#endif
+
+    internal_init_controller(controller_memory_addr, num_stacks);
+
+    // Page aligned stacks all have their busiest part, the top, on the same cache sets. Lowering the top of each
+    // stack by a different multiple of `colour_offset` within a page spreads them out.
+    internal_add_stack_class(0, stack_size);
+    for (int i = 0; i < num_stacks; i++) {
+        const size_t colour = (i * colour_offset) % MINIMUM_STACK_SIZE;
+        if (stack_size - colour < MINIMUM_STACK_SIZE) {
+            microkit_cothread_panic(init_stack_too_small);
+        }
+        if (stack_size - colour < co_controller->stack_class_size[0]) {
+            // spawn_sized() must only pick this class for a size every stack in it can give.
+            co_controller->stack_class_size[0] = stack_size - colour;
+        }
+        internal_add_stack(i + 1, 0, (char *) arena + i * stride, stack_size - colour);
+    }
+
+    // Crash now rather than at the first spawn if the arena is not as big as we think.
+    char *last_stack = (char *) arena + (num_stacks - 1) * stride;
+    ((char *) arena)[0] = 0;
+    last_stack[stack_size - 1] = 0;
+}
+#endif
+
+#ifndef LIBMICROKITCO_MAX_COTHREADS
+size_t microkit_cothread_controller_size(const int max_cothreads) {
+    return sizeof(co_control_t)
+        + (max_cothreads + LIBMICROKITCO_MAX_TASKS) * sizeof(co_tcb_t)
+        + max_cothreads * (sizeof(size_t) + sizeof(co_list_t) + sizeof(microkit_cothread_ref_t));
+}
+
+void microkit_cothread_init_runtime(
+    co_control_t *controller_memory_addr,
+    const size_t controller_memory_size,
+    const microkit_cothread_stack_pool_t *pools,
+    const int num_pools
+) {
+    if (co_controller != NULL) {
+        microkit_cothread_panic(init_already_initialised);
+    }
+
+    // The number of cothreads is the root thread plus one for every co-stack given.
+    int total_stacks = 0;
+    for (int i = 0; i < num_pools; i++) {
+        total_stacks += pools[i].count;
+    }
+    if (controller_memory_size < microkit_cothread_controller_size(total_stacks + 1)) {
+        microkit_cothread_panic(init_controller_too_small);
+    }
+
+    internal_init(controller_memory_addr, pools, num_pools, MINIMUM_STACK_SIZE);
+}
+#elif !defined(LIBMICROKITCO_SHARED_STACK)
+void microkit_cothread_init(
+    co_control_t *controller_memory_addr,
+    const size_t co_stack_size,
+    const stack_ptrs_arg_array_t co_stacks
+) {
+    if (co_controller != NULL) {
+        microkit_cothread_panic(init_already_initialised);
+    }
+
+    const microkit_cothread_stack_pool_t pool = { co_stack_size, LIBMICROKITCO_MAX_COTHREADS - 1, co_stacks };
+    internal_init(controller_memory_addr, &pool, 1, MINIMUM_STACK_SIZE);
+}
+
+void microkit_cothread_init_stack_pools(
+    co_control_t *controller_memory_addr,
+    const microkit_cothread_stack_pool_t *pools,
+    const int num_pools
+) {
+    if (co_controller != NULL) {
+        microkit_cothread_panic(init_already_initialised);
+    }
+
+    internal_init(controller_memory_addr, pools, num_pools, MINIMUM_STACK_SIZE);
+}
+#else
+void microkit_cothread_init_shared_stack(
+    co_control_t *controller_memory_addr,
+    void *shared_stack,
+    const size_t shared_stack_size,
+    const size_t save_buffer_size,
+    const stack_ptrs_arg_array_t save_buffers
+) {
+    if (co_controller != NULL) {
+        microkit_cothread_panic(init_already_initialised);
+    }
+    if (shared_stack == NULL) {
+        microkit_cothread_panic(init_shared_stack_null);
+    }
+    if (shared_stack_size < MINIMUM_STACK_SIZE) {
+        microkit_cothread_panic(init_stack_too_small);
+    }
+
+    const microkit_cothread_stack_pool_t pool = { save_buffer_size, LIBMICROKITCO_MAX_COTHREADS - 1, save_buffers };
+    internal_init(controller_memory_addr, &pool, 1, MINIMUM_SAVE_BUFFER_SIZE);
+
+    // Every cothread starts from the same point on the shared stack, everything from there up is the part to
+    // save. The context written above it by co_derive() is never used.
+#ifdef LIBMICROKITCO_STACK_WATERMARK
+    internal_stack_paint(shared_stack, shared_stack_size);
+    co_controller->shared_stack_bottom = shared_stack;
+#endif
+    const uintptr_t *entry_context = co_derive(shared_stack, shared_stack_size, cothread_entry_wrapper);
+    co_controller->shared_stack_top = (uintptr_t) entry_context;
+    co_controller->shared_stack_entry_sp = entry_context[co_context_sp];
+    co_controller->shared_stack_occupant = LIBMICROKITCO_NULL_HANDLE;
+    co_controller->shared_stack_swapper = co_derive(
+        co_controller->shared_stack_swapper_mem,
+        sizeof(co_controller->shared_stack_swapper_mem),
+        internal_shared_stack_swapper
+    );
+}
+#endif
+
+// Smallest stack class with a free handle whose stacks are at least `min_stack_size`, or -1.
+static inline int internal_find_stack_class(const size_t min_stack_size) {
+    for (int class = 0; class < co_controller->num_stack_classes; class++) {
+        if (co_controller->stack_class_size[class] >= min_stack_size && !internal_list_is_empty(&co_controller->free_handles[class])) {
+            return class;
+        }
+    }
+    return -1;
+}
+
+bool microkit_cothread_free_handle_available(microkit_cothread_ref_t *ret_handle) {
+    const int class = internal_find_stack_class(0);
+    if (class < 0) {
+        return false;
+    }
+
+    *ret_handle = co_controller->free_handles[class].head;
+    return true;
+}
+
+microkit_cothread_ref_t microkit_cothread_spawn(const client_entry_t client_entry, void *private_arg) {
+    return microkit_cothread_spawn_prio(client_entry, private_arg, LIBMICROKITCO_DEFAULT_PRIORITY);
+}
+
+// Exactly one of `client_entry` and `joinable_entry` is given.
+static microkit_cothread_ref_t internal_spawn(
+    const client_entry_t client_entry,
+    const joinable_entry_t joinable_entry,
+    void *private_arg,
+    const microkit_cothread_prio_t priority,
+    const size_t min_stack_size
+) {
+    if (!client_entry && !joinable_entry) {
+        microkit_cothread_panic(spawn_client_entry_is_null);
+    }
+    if (priority >= LIBMICROKITCO_NUM_PRIORITIES) {
+        microkit_cothread_panic(spawn_invalid_priority);
+    }
+
+    const int class = internal_find_stack_class(min_stack_size);
+    if (class < 0) {
+        return LIBMICROKITCO_NULL_HANDLE;
+    }
+    const microkit_cothread_ref_t new = internal_list_pop(&co_controller->free_handles[class]);
+
+    unsigned char *costack = (unsigned char *) co_controller->tcbs[new].local_storage;
+#if defined(LIBMICROKITCO_STACK_WATERMARK)
+    // Painting overwrites the previous cothread's data just as well as zeroing would.
+    internal_stack_paint(costack, co_controller->tcbs[new].stack_size);
+#elif defined(LIBMICROKITCO_ZERO_STACKS)
+    memzero(costack, co_controller->tcbs[new].stack_size);
+#endif
+    co_controller->tcbs[new].client_entry = client_entry;
+    co_controller->tcbs[new].joinable = joinable_entry != NULL;
+    co_controller->tcbs[new].joinable_entry = joinable_entry;
+    co_controller->tcbs[new].joiner.head = LIBMICROKITCO_NULL_HANDLE;
+    co_controller->tcbs[new].joiner.tail = LIBMICROKITCO_NULL_HANDLE;
+    co_controller->tcbs[new].private_arg = private_arg;
+    co_controller->tcbs[new].co_handle = co_derive(costack, co_controller->tcbs[new].stack_size, cothread_entry_wrapper);
+#ifdef LIBMICROKITCO_SHARED_STACK
+    // The context stays in the save buffer but the cothread runs on the shared stack.
+    ((uintptr_t *) co_controller->tcbs[new].co_handle)[co_context_sp] = co_controller->shared_stack_entry_sp;
+    co_controller->tcbs[new].saved_stack_size = 0;
+#endif
+    co_controller->tcbs[new].state = cothread_ready;
+    co_controller->tcbs[new].priority = priority;
+    co_controller->tcbs[new].held_mutexes = NULL;
+#if LIBMICROKITCO_NUM_PRIORITIES > 1
+    co_controller->tcbs[new].base_priority = priority;
+    co_controller->tcbs[new].blocked_on_mutex = NULL;
+#endif
+    co_controller->tcbs[new].timer_heap_idx = TIMER_NOT_QUEUED;
+    co_controller->tcbs[new].timed_wait_on = NULL;
+#ifdef LIBMICROKITCO_TIME_SLICE
+    co_controller->tcbs[new].time_slice = LIBMICROKITCO_TIME_SLICE;
+#endif
+    internal_sched_push(new);
+    return new;
+}
+
+microkit_cothread_ref_t microkit_cothread_spawn_prio(const client_entry_t client_entry, void *private_arg, const microkit_cothread_prio_t priority) {
+    return internal_spawn(client_entry, NULL, private_arg, priority, 0);
+}
+
+microkit_cothread_ref_t microkit_cothread_spawn_sized(const client_entry_t client_entry, void *private_arg, const size_t min_stack_size) {
+    return internal_spawn(client_entry, NULL, private_arg, LIBMICROKITCO_DEFAULT_PRIORITY, min_stack_size);
+}
+
+microkit_cothread_ref_t microkit_cothread_spawn_joinable(const joinable_entry_t joinable_entry, void *private_arg) {
+    if (!joinable_entry) {
+        microkit_cothread_panic(spawn_client_entry_is_null);
+    }
+
+    return internal_spawn(NULL, joinable_entry, private_arg, LIBMICROKITCO_DEFAULT_PRIORITY, 0);
+}
+
+void microkit_cothread_join(const microkit_cothread_ref_t cothread, void **ret_value) {
+    if (cothread >= NUM_COTHREADS || cothread <= LIBMICROKITCO_ROOT_THREAD || co_controller->tcbs[cothread].state == cothread_not_active) {
+        microkit_cothread_panic(generic_invalid_handle);
+    }
+
+    co_tcb_t *tcb = &co_controller->tcbs[cothread];
+    if (!tcb->joinable) {
+        microkit_cothread_panic(join_not_joinable);
+    }
+    if (cothread == co_controller->running) {
+        microkit_cothread_panic(join_cannot_join_self);
+    }
+
+    if (tcb->state != cothread_exited) {
+        if (!internal_list_is_empty(&tcb->joiner)) {
+            microkit_cothread_panic(join_already_joined);
+        }
+        // The root thread must stay available to receive notifications.
+        if (co_controller->running == LIBMICROKITCO_ROOT_THREAD) {
+            microkit_cothread_panic(join_called_from_root);
+        }
+        internal_check_can_block();
+
+        internal_block_on(&tcb->joiner, NULL);
+        internal_go_next();
+    }
+
+    if (ret_value) {
+        *ret_value = tcb->exit_value;
+    }
+    tcb->state = cothread_not_active;
+    internal_release_handle(cothread);
+}
+
+void microkit_cothread_set_arg(const microkit_cothread_ref_t cothread, void *private_arg) {
+    if (cothread >= NUM_HANDLES || cothread < 0 || co_controller->tcbs[cothread].state == cothread_not_active) {
+        microkit_cothread_panic(generic_invalid_handle);
+    }
+
+    co_controller->tcbs[cothread].private_arg = private_arg;
+}
+
+void microkit_cothread_set_prio(const microkit_cothread_ref_t cothread, const microkit_cothread_prio_t priority) {
+    if (cothread >= NUM_HANDLES || cothread < 0 || co_controller->tcbs[cothread].state == cothread_not_active) {
+        microkit_cothread_panic(generic_invalid_handle);
+    }
+    if (priority >= LIBMICROKITCO_NUM_PRIORITIES) {
+        microkit_cothread_panic(set_prio_invalid_priority);
+    }
+
+#if LIBMICROKITCO_NUM_PRIORITIES > 1
+    // Whatever it inherits from the mutexes it holds still applies, and it may now have more to lend.
+    co_tcb_t *tcb = &co_controller->tcbs[cothread];
+    tcb->base_priority = priority;
+    internal_change_prio(cothread, internal_effective_prio(cothread));
+    internal_mutex_boost(tcb->blocked_on_mutex, tcb->priority);
+#else
+    internal_change_prio(cothread, priority);
+#endif
+}
+
+co_state_t microkit_cothread_query_state(const microkit_cothread_ref_t cothread) {
+    if (cothread >= NUM_HANDLES || cothread < 0) {
+        microkit_cothread_panic(generic_invalid_handle);
+    }
+
+    return co_controller->tcbs[cothread].state;
+}
+
+#ifdef LIBMICROKITCO_STACK_WATERMARK
+size_t microkit_cothread_stack_high_water(const microkit_cothread_ref_t cothread) {
+    // Only cothreads have a co-stack, the root thread and tasks do not.
+    if (cothread >= NUM_COTHREADS || cothread <= LIBMICROKITCO_ROOT_THREAD) {
+        microkit_cothread_panic(generic_invalid_handle);
+    }
+
+    // Scan up from the bottom for the first word that is no longer paint, everything above it has been used.
+    const co_tcb_t *tcb = &co_controller->tcbs[cothread];
+    const uintptr_t end = (uintptr_t) tcb->local_storage + tcb->stack_size;
+    const uintptr_t *word = internal_stack_canary(tcb->local_storage);
+    while ((uintptr_t) (word + 1) <= end && *word == STACK_PAINT_WORD) {
+        word++;
+    }
+    return end - (uintptr_t) word;
+}
+#endif
+
+microkit_cothread_ref_t microkit_cothread_my_handle(void) {
+    return co_controller->running;
+}
+
+void *microkit_cothread_my_arg(void) {
+    if (co_controller->running == 0) {
+        microkit_cothread_panic(my_arg_called_from_root);
+    }
+
+    return co_controller->tcbs[co_controller->running].private_arg;
+}
+
+#ifdef LIBMICROKITCO_POLLING
+static bool internal_poll_notifications(void);
+
+// Whether the running cothread should poll now, restarting the count towards the next poll if so.
+static inline bool internal_poll_due(void) {
+    bool due = false;
+#ifdef LIBMICROKITCO_POLL_INTERVAL
+    due = ++co_controller->yields_since_poll >= LIBMICROKITCO_POLL_INTERVAL;
+#endif
+#ifdef LIBMICROKITCO_POLL_CYCLES
+    const uint64_t now = internal_cycle_count();
+    due = due || now - co_controller->last_poll >= LIBMICROKITCO_POLL_CYCLES;
+#endif
+    if (!due) {
+        return false;
+    }
+
+#ifdef LIBMICROKITCO_POLL_INTERVAL
+    co_controller->yields_since_poll = 0;
+#endif
+#ifdef LIBMICROKITCO_POLL_CYCLES
+    co_controller->last_poll = now;
+#endif
+    return true;
+}
+#endif
+
+void microkit_cothread_yield(void) {
+    internal_check_can_block();
+
+#ifdef LIBMICROKITCO_POLLING
+    if (co_controller->event_loop_running && co_controller->running != LIBMICROKITCO_ROOT_THREAD && internal_poll_due()
+        && internal_poll_notifications()) {
+        // Something for notified() or protected(), the root thread dispatches it and we carry on in our turn.
+        internal_handoff(LIBMICROKITCO_ROOT_THREAD);
+        return;
+    }
+#endif
+
+    // Fast path: the caller would just be popped straight back off the scheduling queue, so leave it running.
+    if (!internal_yield_would_switch()) {
+        return;
+    }
+
+    // Caller get pushed onto the appropriate scheduling queue, behind the ready cothreads of it's priority.
+    // If a higher priority cothread is ready, it runs before the caller.
+    internal_make_ready(co_controller->running);
+    internal_go_next();
+}
+
+void microkit_cothread_run_ready(void) {
+    if (co_controller->running != LIBMICROKITCO_ROOT_THREAD) {
+        microkit_cothread_panic(run_ready_called_from_non_root_cothread);
+    }
+
+    // The event loop runs them itself once any PPC has been replied to.
+    if (internal_can_handoff()) {
+        internal_root_run_ready();
+    }
+}
+
+#ifdef LIBMICROKITCO_TIME_SLICE
+void microkit_cothread_yield_if_expired(void) {
+    const uint64_t now = internal_cycle_count();
+    if (now < co_controller->slice_end) {
+        return;
+    }
+
+    // A new slice in case yield() finds nobody to switch to, a switch back to the caller starts one anyway.
+    co_controller->slice_end = now + co_controller->tcbs[co_controller->running].time_slice;
+    microkit_cothread_yield();
+}
+
+void microkit_cothread_set_time_slice(const microkit_cothread_ref_t cothread, const uint64_t cycles) {
+    if (cothread >= NUM_HANDLES || cothread < 0 || co_controller->tcbs[cothread].state == cothread_not_active) {
+        microkit_cothread_panic(generic_invalid_handle);
+    }
+
+    co_controller->tcbs[cothread].time_slice = cycles;
+}
+#endif
+
+static void internal_channel_wait_unlink(const microkit_cothread_ref_t cothread);
+
+// Take a cothread or task out of whatever it is queued on, ready or blocked, and out of the timer heap. The
+// mutexes it holds go to their next waiter. It is left not active for the caller to dispose of.
+static void internal_detach(const microkit_cothread_ref_t cothread) {
+    co_tcb_t *tcb = &co_controller->tcbs[cothread];
+
+    if (tcb->state == cothread_ready) {
+        internal_sched_remove(cothread, tcb->priority);
+    } else if (tcb->state == cothread_blocked && tcb->channel_wait_nodes) {
+        internal_channel_wait_unlink(cothread);
+    } else if (tcb->state == cothread_blocked && tcb->wait_list) {
+        internal_list_remove(tcb->wait_list, cothread);
+        if (tcb->wait_sem) {
+            // If this waiter asked for more units than available, it may have been holding back the ones behind it.
+            internal_sem_grant(tcb->wait_sem);
+        }
+#if LIBMICROKITCO_NUM_PRIORITIES > 1
+        if (tcb->blocked_on_mutex) {
+            microkit_cothread_mutex_t *mutex = tcb->blocked_on_mutex;
+            tcb->blocked_on_mutex = NULL;
+            internal_mutex_unboost(mutex);
+        }
+#endif
+    }
+    // Not in any scheduling queue from here on, so giving back inherited priority below leaves them alone.
+    tcb->state = cothread_not_active;
+
+    if (tcb->timer_heap_idx != TIMER_NOT_QUEUED) {
+        internal_timer_heap_remove(cothread);
+    }
+    while (tcb->held_mutexes) {
+        const microkit_cothread_ref_t new_owner = internal_mutex_release(tcb->held_mutexes, cothread);
+        if (new_owner != LIBMICROKITCO_NULL_HANDLE) {
+            internal_make_ready(new_owner);
+        }
+    }
+}
+
+void microkit_cothread_destroy(const microkit_cothread_ref_t cothread) {
+    if (cothread >= NUM_HANDLES || cothread < 0) {
+        microkit_cothread_panic(generic_invalid_handle);
+    }
+
+    if (co_controller->tcbs[cothread].state == cothread_not_active) {
+        microkit_cothread_panic(destroy_already_not_initialised);
+    }
+
+    if (co_controller->running == 0) {
+        // cannot destroy root thread
+        microkit_cothread_panic(destroy_cannot_destroy_root);
+    }
+
+    // A joinable cothread that is destroyed exits with no value and is released once joined, or destroyed again.
+    if (co_controller->tcbs[cothread].joinable && co_controller->tcbs[cothread].state != cothread_exited) {
+        internal_exit(cothread, NULL);
+        return;
+    }
+
+    // Unlink it right away so neither the scheduler nor a waiting queue ever sees a dead or recycled handle.
+    internal_detach(cothread);
+
+#if LIBMICROKITCO_MAX_TASKS
+    if (internal_is_task(cothread)) {
+        // A task destroying itself just returns to whoever ran it.
+        internal_task_release(cothread);
+        return;
+    }
+#endif
+
+#ifdef LIBMICROKITCO_SHARED_STACK
+    // Nothing left on the shared stack worth saving.
+    if (cothread == co_controller->shared_stack_occupant) {
+        co_controller->shared_stack_occupant = LIBMICROKITCO_NULL_HANDLE;
+    }
+#endif
+
+    if (cothread == co_controller->running) {
+        // Still running on the stack, the handle is released by whoever runs next.
+        co_controller->zombie = cothread;
+        internal_go_next();
+    } else {
+        internal_release_handle(cothread);
+    }
+}
+
+#if LIBMICROKITCO_MAX_TASKS
+microkit_cothread_ref_t microkit_cothread_spawn_task(const task_entry_t task_entry, void *private_arg) {
+    if (!task_entry) {
+        microkit_cothread_panic(spawn_task_entry_is_null);
+    }
+    if (internal_list_is_empty(&co_controller->free_tasks)) {
+        return LIBMICROKITCO_NULL_HANDLE;
+    }
+
+    const microkit_cothread_ref_t new = internal_list_pop(&co_controller->free_tasks);
+    co_tcb_t *tcb = &co_controller->tcbs[new];
+    tcb->task_entry = task_entry;
+    tcb->task_resume_point = 0;
+    tcb->task_wait_granted = false;
+    tcb->private_arg = private_arg;
+    tcb->state = cothread_ready;
+    tcb->priority = LIBMICROKITCO_DEFAULT_PRIORITY;
+    tcb->held_mutexes = NULL;
+#if LIBMICROKITCO_NUM_PRIORITIES > 1
+    tcb->base_priority = LIBMICROKITCO_DEFAULT_PRIORITY;
+    tcb->blocked_on_mutex = NULL;
+#endif
+    tcb->timer_heap_idx = TIMER_NOT_QUEUED;
+    tcb->timed_wait_on = NULL;
+    internal_sched_push(new);
+    return new;
+}
+
+unsigned int *microkit_cothread_task_resume_point(void) {
+    return &co_controller->tcbs[co_controller->running].task_resume_point;
+}
+
+bool microkit_cothread_task_wait(microkit_cothread_sem_t *sem) {
+    co_tcb_t *tcb = &co_controller->tcbs[co_controller->running];
+
+    // Resumed after blocking here: the signaller already took the unit on our behalf.
+    if (tcb->task_wait_granted) {
+        tcb->task_wait_granted = false;
+        return true;
+    }
+
+    if (sem->count > 0 && internal_list_is_empty(&sem->waiting)) {
+        sem->count--;
+        return true;
+    }
+
+    tcb->wait_n = 1;
+    tcb->task_wait_granted = true;
+    internal_block_on(&sem->waiting, sem);
+    return false;
+}
+#endif
+
+microkit_cothread_sem_t *microkit_cothread_channel_sem(const microkit_channel ch) {
+    if (ch >= MICROKIT_MAX_CHANNELS) {
+        microkit_cothread_panic(channel_sem_invalid_channel);
+    }
+
+    return &co_controller->blocked_channel_map[ch];
+}
+
+void microkit_cothread_wait_on_channel(const microkit_channel wake_on) {
+    if (wake_on >= MICROKIT_MAX_CHANNELS) {
+        microkit_cothread_panic(wait_on_channel_invalid_channel);
+    }
+
+    microkit_cothread_semaphore_wait(&co_controller->blocked_channel_map[wake_on]);
+}
+
+// Consume every notification remembered on the channels in `mask`, returns the channels that had one.
+static inline uint64_t internal_channels_take_fired(const uint64_t mask) {
+    uint64_t fired = 0;
+    uint64_t remaining = mask;
+    while (remaining) {
+        const unsigned ch = __builtin_ctzll(remaining);
+        remaining &= remaining - 1;
+
+        microkit_cothread_sem_t *sem = &co_controller->blocked_channel_map[ch];
+        if (sem->count) {
+            sem->count = 0;
+            fired |= 1ull << ch;
+        }
+    }
+    return fired;
+}
+
+// The links of a cothread blocked in `wait_on_channels()` in the waiting queue of `ch`, one of it's channels.
+static inline co_channel_wait_node_t *internal_channel_wait_node(const microkit_cothread_ref_t cothread, const microkit_channel ch) {
+    const co_tcb_t *tcb = &co_controller->tcbs[cothread];
+    co_channel_wait_node_t *nodes = internal_blocked_addr(cothread, tcb->channel_wait_nodes);
+    return &nodes[__builtin_popcountll(tcb->channel_mask & ((1ull << ch) - 1))];
+}
+
+static inline void internal_channel_wait_append(const microkit_channel ch, const microkit_cothread_ref_t cothread) {
+    co_list_t *queue = &co_controller->channel_waiters[ch];
+    co_channel_wait_node_t *node = internal_channel_wait_node(cothread, ch);
+    node->next = LIBMICROKITCO_NULL_HANDLE;
+    node->prev = queue->tail;
+
+    if (queue->tail == LIBMICROKITCO_NULL_HANDLE) {
+        queue->head = cothread;
+    } else {
+        internal_channel_wait_node(queue->tail, ch)->next = cothread;
+    }
+    queue->tail = cothread;
+}
+
+static inline void internal_channel_wait_remove(const microkit_channel ch, const microkit_cothread_ref_t cothread) {
+    co_list_t *queue = &co_controller->channel_waiters[ch];
+    const co_channel_wait_node_t *node = internal_channel_wait_node(cothread, ch);
+
+    if (node->prev == LIBMICROKITCO_NULL_HANDLE) {
+        queue->head = node->next;
+    } else {
+        internal_channel_wait_node(node->prev, ch)->next = node->next;
+    }
+    if (node->next == LIBMICROKITCO_NULL_HANDLE) {
+        queue->tail = node->prev;
+    } else {
+        internal_channel_wait_node(node->next, ch)->prev = node->prev;
+    }
+}
+
+// Take a cothread blocked in `wait_on_channels()` out of the queue of every channel it waits on.
+static void internal_channel_wait_unlink(const microkit_cothread_ref_t cothread) {
+    uint64_t remaining = co_controller->tcbs[cothread].channel_mask;
+    while (remaining) {
+        const microkit_channel ch = __builtin_ctzll(remaining);
+        remaining &= remaining - 1;
+        internal_channel_wait_remove(ch, cothread);
+    }
+    co_controller->tcbs[cothread].channel_wait_nodes = NULL;
+}
+
+uint64_t microkit_cothread_wait_on_channels(const uint64_t wake_on_mask) {
+    if (!wake_on_mask || wake_on_mask >> MICROKIT_MAX_CHANNELS) {
+        microkit_cothread_panic(wait_on_channels_invalid_mask);
+    }
+    internal_check_can_block();
+
+    // Consume every notification in the mask that arrived before we started waiting.
+    const uint64_t fired = internal_channels_take_fired(wake_on_mask);
+    if (fired) {
+        return fired;
+    }
+
+    // Queue up on every channel, so a notification only has to look at the first waiter of it's own channel.
+    co_channel_wait_node_t nodes[__builtin_popcountll(wake_on_mask)];
+    co_tcb_t *tcb = &co_controller->tcbs[co_controller->running];
+    tcb->channel_mask = wake_on_mask;
+    tcb->channel_wait_nodes = nodes;
+    uint64_t remaining = wake_on_mask;
+    while (remaining) {
+        const microkit_channel ch = __builtin_ctzll(remaining);
+        remaining &= remaining - 1;
+        internal_channel_wait_append(ch, co_controller->running);
+    }
+    internal_block_on(NULL, NULL);
+    internal_go_next();
+
+    // Woken by one channel, the others in the mask that fired since and that nobody else was waiting for are ours too.
+    return tcb->channel_mask | internal_channels_take_fired(wake_on_mask);
+}
+
+// Wake whoever is waiting on `ch`: cothreads in `wait_on_channel()` first, then `wait_on_channels()`. The woken
+// cothread is made ready and returned, if nobody is waiting the notification is remembered in the channel's sem.
+static inline microkit_cothread_ref_t internal_channel_unblock(const microkit_channel ch) {
+    microkit_cothread_sem_t *sem = &co_controller->blocked_channel_map[ch];
+    const microkit_cothread_ref_t waiter = co_controller->channel_waiters[ch].head;
+    if (internal_list_is_empty(&sem->waiting) && waiter != LIBMICROKITCO_NULL_HANDLE) {
+        internal_channel_wait_unlink(waiter);
+        co_controller->tcbs[waiter].channel_mask = 1ull << ch;
+        internal_make_ready(waiter);
+        return waiter;
+    }
+    return internal_sem_release(sem, 1);
+}
+
+void microkit_cothread_recv_ntfn(const microkit_channel ch) {
+    if (co_controller->running != LIBMICROKITCO_ROOT_THREAD) {
+        microkit_cothread_panic(recv_ntfn_called_from_non_root_cothread);
+    }
+    if (ch >= MICROKIT_MAX_CHANNELS) {
+        microkit_cothread_panic(recv_ntfn_invalid_channel);
+    }
+
+    if (co_controller->timer_initialised && ch == co_controller->timer_channel) {
+        // Run the cothreads whose timeout expired, whatever their priority, unless we are dispatching from the
+        // event loop which runs them after any PPC reply.
+        const bool woken = internal_timer_expire();
+#ifndef LIBMICROKITCO_PREEMPTIVE_UNBLOCK
+        if (woken && internal_can_handoff()) {
+            internal_root_run_ready();
+        }
+#endif
+        return;
+    }
+
+    const microkit_cothread_ref_t unblocked = internal_channel_unblock(ch);
+    if (unblocked != LIBMICROKITCO_NULL_HANDLE) {
+        internal_wake_queued(unblocked);
+    }
+}
+
+void microkit_cothread_recv_ntfn_broadcast(const microkit_channel ch) {
+    if (co_controller->running != LIBMICROKITCO_ROOT_THREAD) {
+        microkit_cothread_panic(recv_ntfn_called_from_non_root_cothread);
+    }
+    if (ch >= MICROKIT_MAX_CHANNELS) {
+        microkit_cothread_panic(recv_ntfn_invalid_channel);
+    }
+    if (co_controller->timer_initialised && ch == co_controller->timer_channel) {
+        microkit_cothread_recv_ntfn(ch);
+        return;
+    }
+
+    microkit_cothread_sem_t *sem = &co_controller->blocked_channel_map[ch];
+    microkit_cothread_ref_t first = sem->waiting.head;
+    internal_list_make_ready(&sem->waiting);
+
+    microkit_cothread_ref_t waiter;
+    while ((waiter = co_controller->channel_waiters[ch].head) != LIBMICROKITCO_NULL_HANDLE) {
+        internal_channel_wait_unlink(waiter);
+        co_controller->tcbs[waiter].channel_mask = 1ull << ch;
+        if (first == LIBMICROKITCO_NULL_HANDLE) {
+            first = waiter;
+        }
+        internal_make_ready(waiter);
+    }
+
+    if (first == LIBMICROKITCO_NULL_HANDLE) {
+        // Nobody to wake, remember the notification like recv_ntfn() does.
+        internal_sem_release(sem, 1);
+    } else {
+        internal_wake_queued(first);
+    }
+}
+
+// Wake the cothreads waiting on the channels of a notification badge that are dispatched to cothreads. Nothing runs
+// until the whole badge has been walked. Returns the channels left for notified().
+static seL4_Word internal_wake_channels(const seL4_Word badge) {
+    seL4_Word remaining = badge & co_controller->event_loop_channels;
+    while (remaining) {
+        const microkit_channel ch = __builtin_ctzll(remaining);
+        remaining &= remaining - 1;
+
+        if (co_controller->timer_initialised && ch == co_controller->timer_channel) {
+            internal_timer_expire();
+        } else {
+            internal_channel_unblock(ch);
+        }
+    }
+    return badge & ~co_controller->event_loop_channels;
+}
+
+// Handle a single event received by the event loop. Returns whether the event was a PPC that needs a reply in `reply_tag`.
+static bool internal_dispatch_event(const seL4_Word badge, const seL4_MessageInfo_t tag, seL4_MessageInfo_t *reply_tag) {
+    if (badge >> 63) {
+        *reply_tag = protected(badge & EVENT_LOOP_CHANNEL_BITS, tag);
+        return true;
+    }
+    if ((badge >> 62) & 1) {
+        // Child PD faults are not handled here, such PDs must keep the Microkit event loop.
+        microkit_cothread_panic(event_loop_unexpected_fault);
+    }
+
+    seL4_Word remaining = internal_wake_channels(badge);
+    while (remaining) {
+        const microkit_channel ch = __builtin_ctzll(remaining);
+        remaining &= remaining - 1;
+        notified(ch);
+    }
+    return false;
+}
+
+#ifdef LIBMICROKITCO_POLLING
+// Pick up whatever the PD received since the root thread last ran, without blocking. Cothreads waiting on the
+// channels that fired are only marked ready so the caller still goes through the scheduler as usual. Anything
+// for notified() or protected() is left for the root thread, returns whether there is. The caller must switch
+// to it right away so nothing else can touch the IPC buffer or the reply cap first.
+static bool internal_poll_notifications(void) {
+    // Receiving would overwrite the reply cap. The event loop sends replies before letting any cothread run,
+    // so this is only a safety net.
+    if (co_controller->event_loop_reply_pending) {
+        return false;
+    }
+
+    seL4_Word badge;
+    const seL4_MessageInfo_t tag = seL4_NBRecv(INPUT_CAP, &badge, REPLY_CAP);
+    if (!(badge >> 62)) {
+        badge = internal_wake_channels(badge);
+        if (!badge) {
+            return false;
+        }
+    }
+
+    co_controller->polled_badge = badge;
+    co_controller->polled_tag = tag;
+    return true;
+}
+#endif
+
+void microkit_cothread_event_loop(const uint64_t cothread_channels) {
+    if (co_controller->running != LIBMICROKITCO_ROOT_THREAD) {
+        microkit_cothread_panic(event_loop_called_from_non_root_cothread);
+    }
+
+    co_controller->event_loop_channels = cothread_channels;
+    co_controller->event_loop_running = true;
+
+    seL4_MessageInfo_t reply_tag;
+
+    while (true) {
+        // One scheduling round: the root thread steps aside until every cothread has blocked again.
+        internal_root_run_ready();
+
+        seL4_Word badge;
+        seL4_MessageInfo_t tag;
+
+#ifdef LIBMICROKITCO_POLLING
+        if (co_controller->polled_badge) {
+            // A polling cothread switched here to have this dispatched, nothing has touched the IPC buffer since.
+            badge = co_controller->polled_badge;
+            tag = co_controller->polled_tag;
+            co_controller->polled_badge = 0;
+        } else
+#endif
+        if (co_controller->event_loop_reply_pending) {
+            tag = seL4_ReplyRecv(INPUT_CAP, reply_tag, &badge, REPLY_CAP);
+        } else if (microkit_have_signal) {
+            tag = seL4_NBSendRecv(microkit_signal_cap, microkit_signal_msg, INPUT_CAP, &badge, REPLY_CAP);
+            microkit_have_signal = seL4_False;
+        } else {
+            tag = seL4_Recv(INPUT_CAP, &badge, REPLY_CAP);
+        }
+
+        co_controller->event_loop_reply_pending = internal_dispatch_event(badge, tag, &reply_tag);
+
+        // The caller of a PPC must not wait behind the scheduling round, only fold the reply into the next
+        // receive when no cothread is going to run first.
+        if (co_controller->event_loop_reply_pending && co_controller->ready_bitmap) {
+            seL4_Send(REPLY_CAP, reply_tag);
+            co_controller->event_loop_reply_pending = false;
+        }
+    }
 }
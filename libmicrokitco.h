@@ -12,28 +12,96 @@
 
 #include <libmicrokitco_opts.h>
 
-// Cothread handle.
-typedef int microkit_cothread_ref_t;
 #include "libhostedqueue/libhostedqueue.h"
 
-// This err is caught by the provided Makefile so we should never trigger this. But it's included
-// in case the client want to compile the library manually.
-#ifndef LIBMICROKITCO_MAX_COTHREADS
-#error "libmicrokitco: max_cothreads must be known at compile time."
-#endif
+// Cothread handle.
+typedef int microkit_cothread_ref_t;
 
+// If LIBMICROKITCO_MAX_COTHREADS is not defined, the number of cothreads is only known once
+// `microkit_cothread_init_runtime()` is called, and the controller's arrays are placed right after it in the
+// memory given to the library. Defining it lets the compiler fold the cothread count into the library.
+#ifdef LIBMICROKITCO_MAX_COTHREADS
 // No point to use this library if you only have the root PD thread.
 #if LIBMICROKITCO_MAX_COTHREADS < 2
 #error "libmicrokitco: max_cothreads must be greater or equal to 2."
 #endif
+#endif
+
+// Number of scheduling priority levels, a single level gives plain FIFO scheduling.
+#ifndef LIBMICROKITCO_NUM_PRIORITIES
+#define LIBMICROKITCO_NUM_PRIORITIES 1
+#endif
+
+// The ready bitmap is one 32-bit word.
+#if LIBMICROKITCO_NUM_PRIORITIES < 1 || LIBMICROKITCO_NUM_PRIORITIES > 32
+#error "libmicrokitco: num_priorities must be between 1 and 32."
+#endif
+
+// Priority given to the root thread and to cothreads created with `microkit_cothread_spawn()`.
+#ifndef LIBMICROKITCO_DEFAULT_PRIORITY
+#define LIBMICROKITCO_DEFAULT_PRIORITY 0
+#endif
+
+#if LIBMICROKITCO_DEFAULT_PRIORITY < 0 || LIBMICROKITCO_DEFAULT_PRIORITY >= LIBMICROKITCO_NUM_PRIORITIES
+#error "libmicrokitco: default_priority must be less than num_priorities."
+#endif
+
+// Number of stackless tasks, on top of LIBMICROKITCO_MAX_COTHREADS. Tasks share the handle space of cothreads,
+// so their handles start at LIBMICROKITCO_MAX_COTHREADS.
+#ifndef LIBMICROKITCO_MAX_TASKS
+#define LIBMICROKITCO_MAX_TASKS 0
+#endif
+
+#if LIBMICROKITCO_MAX_TASKS < 0
+#error "libmicrokitco: max_tasks must not be negative."
+#endif
+
+#ifdef LIBMICROKITCO_MAX_COTHREADS
+#define LIBMICROKITCO_MAX_HANDLES (LIBMICROKITCO_MAX_COTHREADS + LIBMICROKITCO_MAX_TASKS)
+#endif
+
+// If defined, a cothread polls the PD's notifications every LIBMICROKITCO_POLL_INTERVAL calls to
+// `microkit_cothread_yield()` once `microkit_cothread_event_loop()` is running.
+#if defined(LIBMICROKITCO_POLL_INTERVAL) && LIBMICROKITCO_POLL_INTERVAL < 1
+#error "libmicrokitco: poll_interval must be at least 1."
+#endif
+
+// If defined, a cothread also polls them in `microkit_cothread_yield()` once LIBMICROKITCO_POLL_CYCLES ticks of the
+// cycle counter have passed since the last poll. The counter is read with LIBMICROKITCO_CYCLE_COUNT() if that is defined.
+#if defined(LIBMICROKITCO_POLL_CYCLES) && LIBMICROKITCO_POLL_CYCLES < 1
+#error "libmicrokitco: poll_cycles must be at least 1."
+#endif
+
+// If defined, a cothread's time slice is LIBMICROKITCO_TIME_SLICE ticks of the cycle counter by default, see
+// `microkit_cothread_yield_if_expired()`. The counter is read with LIBMICROKITCO_CYCLE_COUNT() if that is defined.
+#if defined(LIBMICROKITCO_TIME_SLICE) && LIBMICROKITCO_TIME_SLICE < 1
+#error "libmicrokitco: time_slice must be at least 1."
+#endif
+
+// If defined, all cothreads run on one shared execution stack and the memory given to the library for each
+// cothread only holds a copy of the live part of it's stack while it is switched out.
+#ifdef LIBMICROKITCO_SHARED_STACK
+#ifndef LIBMICROKITCO_MAX_COTHREADS
+#error "libmicrokitco: shared_stack needs max_cothreads to be known at compile time."
+#endif
+
+// Words of private stack for the context that copies stacks in and out of the shared stack.
+#define LIBMICROKITCO_SWAPPER_STACK_WORDS 256
+#endif
 
 // ========== BEGIN DATA TYPES SECTION ==========
 
 #define LIBMICROKITCO_NULL_HANDLE -1
 
+// Scheduling priority, higher value is more urgent.
+typedef unsigned int microkit_cothread_prio_t;
+
 // The form of client entrypoint function.
 typedef void (*client_entry_t)(void);
 
+// The form of a joinable cothread's entrypoint, the return value is handed to `microkit_cothread_join()`.
+typedef void *(*joinable_entry_t)(void);
+
 typedef enum {
     // This id is not being used
     cothread_not_active = 0,
@@ -41,96 +109,500 @@ typedef enum {
     cothread_blocked,
     cothread_ready,
     cothread_running,
+
+    // A joinable cothread that has returned, it's handle is released once it is joined.
+    cothread_exited,
 } co_state_t;
 
 typedef void *cothread_t;
 
+// What a stackless task's entry returns each time it gives up the CPU.
+typedef enum {
+    co_task_yielded = 0,
+    co_task_blocked,
+    co_task_done,
+} co_task_status_t;
+
+// The form of a stackless task entrypoint. It is called again from the start every time the task is
+// scheduled, see the MICROKIT_COTHREAD_TASK_* macros.
+typedef co_task_status_t (*task_entry_t)(void);
+
+// Timestamps and durations, in whatever unit the client provided clock counts in.
+typedef uint64_t microkit_cothread_time_t;
+
+// Client provided clock: returns the current time.
+typedef microkit_cothread_time_t (*co_timer_now_t)(void);
+// Client provided clock: request a notification on the timer channel at or after the given absolute time.
+typedef void (*co_timer_set_timeout_t)(microkit_cothread_time_t deadline);
+
+// Outcome of a wait with timeout.
+typedef enum {
+    co_wait_signalled = 0,
+    co_wait_timed_out,
+} co_wait_result_t;
+
+// Outcome of a channel operation.
+typedef enum {
+    co_chan_ok = 0,
+    co_chan_would_block,
+    co_chan_closed,
+} co_chan_result_t;
+
+// A semaphore and a mutex, defined below.
+struct microkit_cothread_sem;
+struct microkit_cothread_mutex;
+
+// Head and tail of an intrusive doubly linked list of cothreads.
+typedef struct {
+    microkit_cothread_ref_t head;
+    microkit_cothread_ref_t tail;
+} co_list_t;
+
+// Links of a cothread in the waiting queue of one of the channels it is blocked on in `wait_on_channels()`.
+typedef struct {
+    microkit_cothread_ref_t next;
+    microkit_cothread_ref_t prev;
+} co_channel_wait_node_t;
+
 typedef struct {
     // Thread local storage: context + stack
     void *local_storage;
     cothread_t co_handle;
 
+    // Size of local_storage and the stack pool it belongs to.
+    size_t stack_size;
+    int stack_class;
+
     // Entrypoint for cothread
     client_entry_t client_entry;
     void *private_arg;
 
+    // Joinable cothreads only: entrypoint, it's return value once exited and the cothread waiting to join it,
+    // kept as a list so a joiner is blocked on it like on any other queue.
+    bool joinable;
+    joinable_entry_t joinable_entry;
+    void *exit_value;
+    co_list_t joiner;
+
     // Current execution state
     co_state_t state;
 
-    microkit_cothread_ref_t next_blocked_on_same_event;
+    // Which scheduling queue this cothread goes into when it is ready
+    microkit_cothread_prio_t priority;
+
+    // The mutexes this cothread holds, most recently locked first.
+    struct microkit_cothread_mutex *held_mutexes;
+
+#if LIBMICROKITCO_NUM_PRIORITIES > 1
+    // Priority inheritance: the priority this cothread was given, `priority` may be higher while it holds a mutex
+    // that a more urgent cothread is waiting on. And the mutex it is blocked on, if any.
+    microkit_cothread_prio_t base_priority;
+    struct microkit_cothread_mutex *blocked_on_mutex;
+#endif
+
+    // Links of the intrusive doubly linked list this cothread is currently in. Which is either the
+    // scheduling queue of it's priority when ready, or the waiting queue of a sem/event when blocked.
+    microkit_cothread_ref_t next;
+    microkit_cothread_ref_t prev;
+
+    // The waiting queue this cothread is in while blocked, NULL if it only waits for a timeout, and the semaphore
+    // that queue belongs to if any. So it can be taken off in constant time when destroyed.
+    co_list_t *wait_list;
+    struct microkit_cothread_sem *wait_sem;
+
+    // Number of semaphore units this cothread is blocked waiting for.
+    unsigned int wait_n;
+
+    // Bitmask of the channels this cothread is blocked on in `wait_on_channels()`, then the channel that
+    // woke it up once unblocked. While blocked, it's links in the waiting queue of each of those channels,
+    // one per channel in channel order, on it's stack.
+    uint64_t channel_mask;
+    co_channel_wait_node_t *channel_wait_nodes;
+
+    // Timed wait bookkeeping: absolute deadline, index in the timer heap or -1 if not in the heap, the
+    // semaphore being waited on if any and how the wait ended.
+    microkit_cothread_time_t deadline;
+    int timer_heap_idx;
+    struct microkit_cothread_sem *timed_wait_on;
+    co_wait_result_t wait_result;
+
+    // Blocked in a channel send or receive: where the item is copied from or to, and how the operation ended.
+    void *chan_item;
+    co_chan_result_t chan_result;
+
+    // Blocked in `future_await_all()` or `future_await_any()`: the futures and whether all of them are needed.
+    struct microkit_cothread_future *const *awaiting;
+    int awaiting_n;
+    bool awaiting_all;
+
+#ifdef LIBMICROKITCO_TIME_SLICE
+    // Cycles this cothread may run for each time it is switched to before `yield_if_expired()` yields.
+    uint64_t time_slice;
+#endif
+
+#if LIBMICROKITCO_MAX_TASKS
+    // Stackless task only: entrypoint, where to resume in it and whether it has just been granted the
+    // semaphore it blocked on.
+    task_entry_t task_entry;
+    unsigned int task_resume_point;
+    bool task_wait_granted;
+#endif
+
+#ifdef LIBMICROKITCO_SHARED_STACK
+    // Bytes of this cothread's stack currently saved below it's context in local_storage.
+    size_t saved_stack_size;
+#endif
 } co_tcb_t;
 
 // A linked list data structure that manage all cothreads blocking on a specific sem/event.
+typedef struct microkit_cothread_sem {
+    // Number of signals not yet consumed by a wait, never more than max_count. A binary semaphore has a
+    // max_count of 1 so it is "set" when count is 1.
+    unsigned int count;
+    unsigned int max_count;
+
+    // Cothreads waiting on this semaphore in FIFO order
+    co_list_t waiting;
+} microkit_cothread_sem_t;
+
+// A mutex owned by the cothread that locked it.
+typedef struct microkit_cothread_mutex {
+    // LIBMICROKITCO_NULL_HANDLE when unlocked.
+    microkit_cothread_ref_t owner;
+
+    // Cothreads waiting to lock, the most urgent is given the mutex on unlock and FIFO among equals.
+    co_list_t waiting;
+
+    // Next mutex held by the same owner.
+    struct microkit_cothread_mutex *next_held;
+} microkit_cothread_mutex_t;
+
+// A condition variable, cothreads waiting on it in FIFO order.
 typedef struct {
-    // True if the sem is signaled without any cothread waiting on it.
-    bool set;
+    co_list_t waiting;
+} microkit_cothread_cond_t;
 
-    // First cothread waiting on this semaphore
-    microkit_cothread_ref_t head;
-    microkit_cothread_ref_t tail;
-} microkit_cothread_sem_t;
+// A bounded channel of fixed size items between cothreads, the buffer is provided by the client.
+typedef struct {
+    hosted_queue_t queue;
+    void *buffer;
+    bool closed;
+
+    // Cothreads blocked on a full or empty channel in FIFO order. At most one of them is non-empty.
+    co_list_t senders;
+    co_list_t receivers;
+} microkit_cothread_chan_t;
+
+// The form of a work item's function in a worker pool.
+typedef void (*pool_work_fn_t)(void *arg);
+
+typedef struct {
+    pool_work_fn_t fn;
+    void *arg;
+} microkit_cothread_pool_work_t;
+
+// Resident worker cothreads that run work items from a ring in FIFO order, the ring is provided by the client.
+typedef struct {
+    microkit_cothread_chan_t ring;
+} microkit_cothread_pool_t;
+
+// The result of an asynchronous request, completed once by whoever gets the answer.
+typedef struct microkit_cothread_future {
+    bool completed;
+    void *value;
+
+    // Cothreads in `future_await()` on this future alone in FIFO order.
+    co_list_t waiting;
+} microkit_cothread_future_t;
 
 typedef struct cothreads_control {
-    int co_stack_size;
     microkit_cothread_ref_t running;
 
-    // Array of cothreads, first index is root thread AND len(tcbs) == (max_cothreads + 1)
-    co_tcb_t tcbs[LIBMICROKITCO_MAX_COTHREADS];
+    // Array of cothreads, first index is root thread AND len(tcbs) == (max_cothreads + 1), followed by the tasks
+#ifdef LIBMICROKITCO_MAX_COTHREADS
+    co_tcb_t tcbs[LIBMICROKITCO_MAX_HANDLES];
+#else
+    int max_cothreads;
+    co_tcb_t *tcbs;
+#endif
+
+    // Bit N is set when the scheduling queue of priority N is non-empty.
+    uint32_t ready_bitmap;
+
+    // Free cothread handles of each stack pool in FIFO order, linked through their TCBs. Pools are sorted by
+    // ascending stack size.
+    int num_stack_classes;
+#ifdef LIBMICROKITCO_MAX_COTHREADS
+    size_t stack_class_size[LIBMICROKITCO_MAX_COTHREADS];
+    co_list_t free_handles[LIBMICROKITCO_MAX_COTHREADS];
+#else
+    size_t *stack_class_size;
+    co_list_t *free_handles;
+#endif
+
+    // A cothread that destroyed itself, it's handle is released once execution has left it's stack.
+    microkit_cothread_ref_t zombie;
 
-    // All of these are queues of `microkit_cothread_ref_t`
-    hosted_queue_t free_handle_queue;
-    hosted_queue_t scheduling_queue;
+#if LIBMICROKITCO_MAX_TASKS
+    // Free task handles, linked through their TCBs.
+    co_list_t free_tasks;
+#endif
 
-    // Arrays for queues.
-    microkit_cothread_ref_t free_handle_queue_mem[LIBMICROKITCO_MAX_COTHREADS];
-    microkit_cothread_ref_t scheduling_queue_mem[LIBMICROKITCO_MAX_COTHREADS];
+    // Ready cothreads of each priority, linked through their TCBs.
+    co_list_t scheduling_queues[LIBMICROKITCO_NUM_PRIORITIES];
 
     // Map of linked list on what cothreads are blocked on which channel.
     microkit_cothread_sem_t blocked_channel_map[MICROKIT_MAX_CHANNELS];
+
+    // Cothreads blocked on a set of channels, in FIFO order in the queue of every channel in their set. A
+    // notification goes to the waiters of that channel in blocked_channel_map first, then to the first in here.
+    co_list_t channel_waiters[MICROKIT_MAX_CHANNELS];
+
+    // Cothreads blocked on a set of futures in FIFO order, each completion checks them all.
+    co_list_t future_waiters;
+
+    // Timer subsystem, driven by notifications on `timer_channel` from a client specified timer.
+    bool timer_initialised;
+    microkit_channel timer_channel;
+    co_timer_now_t timer_now;
+    co_timer_set_timeout_t timer_set_timeout;
+
+    // Binary min-heap of cothreads in a timed wait, keyed by their deadline.
+    int timer_heap_size;
+#ifdef LIBMICROKITCO_MAX_COTHREADS
+    microkit_cothread_ref_t timer_heap[LIBMICROKITCO_MAX_COTHREADS];
+#else
+    microkit_cothread_ref_t *timer_heap;
+#endif
+
+    // Set once the root thread enters `microkit_cothread_event_loop()` with these channels, and whether the
+    // reply cap holds the reply to a PPC that is yet to be sent.
+    bool event_loop_running;
+    uint64_t event_loop_channels;
+    bool event_loop_reply_pending;
+
+#if defined(LIBMICROKITCO_POLL_INTERVAL) || defined(LIBMICROKITCO_POLL_CYCLES)
+    // An event picked up by a polling cothread for the root thread to dispatch, the badge is 0 if none.
+    seL4_Word polled_badge;
+    seL4_MessageInfo_t polled_tag;
+#endif
+#ifdef LIBMICROKITCO_POLL_INTERVAL
+    unsigned int yields_since_poll;
+#endif
+#ifdef LIBMICROKITCO_POLL_CYCLES
+    // Cycle count at the last poll.
+    uint64_t last_poll;
+#endif
+
+#ifdef LIBMICROKITCO_TIME_SLICE
+    // Cycle count at which the running cothread's time slice runs out.
+    uint64_t slice_end;
+#endif
+
+#ifdef LIBMICROKITCO_SHARED_STACK
+    // Highest address of the shared stack that cothreads use, and the stack pointer a new cothread starts on.
+    uintptr_t shared_stack_top;
+    uintptr_t shared_stack_entry_sp;
+
+    // Cothread whose frames are on the shared stack right now, they are only saved once another cothread
+    // needs it. Switching to the root thread and back to the same cothread copies nothing.
+    microkit_cothread_ref_t shared_stack_occupant;
+
+    // Cothread to run once the swapper has moved it's stack in.
+    microkit_cothread_ref_t shared_stack_swap_target;
+    cothread_t shared_stack_swapper;
+    uintptr_t shared_stack_swapper_mem[LIBMICROKITCO_SWAPPER_STACK_WORDS];
+
+#ifdef LIBMICROKITCO_STACK_WATERMARK
+    // Lowest address of the shared stack, where it's canary lives.
+    void *shared_stack_bottom;
+#endif
+#endif
 } co_control_t;
 
+#ifdef LIBMICROKITCO_MAX_COTHREADS
 #define LIBMICROKITCO_CONTROLLER_SIZE sizeof(co_control_t)
+#endif
 
 // ========== END DATA TYPES SECTION ==========
 
 
 // ========== BEGIN API SECTION ==========
 
+// A pool of `count` co-stacks of `stack_size` bytes each, `stacks` points to an array of where each co-stack starts.
+typedef struct {
+    size_t stack_size;
+    int count;
+    const uintptr_t *stacks;
+} microkit_cothread_stack_pool_t;
+
+#ifdef LIBMICROKITCO_MAX_COTHREADS
 // You need to provide (LIBMICROKITCO_MAX_COTHREADS - 1) stack pointers for the coroutines.
 // -1 because the root thread already have a stack
 typedef uintptr_t stack_ptrs_arg_array_t[LIBMICROKITCO_MAX_COTHREADS - 1];
 
+#ifndef LIBMICROKITCO_SHARED_STACK
 void microkit_cothread_init(
     co_control_t *controller_memory_addr,
     const size_t co_stack_size,
     const stack_ptrs_arg_array_t co_stacks
 );
 
+void microkit_cothread_init_stack_pools(
+    co_control_t *controller_memory_addr,
+    const microkit_cothread_stack_pool_t *pools,
+    const int num_pools
+);
+#else
+void microkit_cothread_init_shared_stack(
+    co_control_t *controller_memory_addr,
+    void *shared_stack,
+    const size_t shared_stack_size,
+    const size_t save_buffer_size,
+    const stack_ptrs_arg_array_t save_buffers
+);
+#endif
+#else
+// Bytes of controller memory needed for `max_cothreads` cothreads, including the root thread.
+size_t microkit_cothread_controller_size(const int max_cothreads);
+
+void microkit_cothread_init_runtime(
+    co_control_t *controller_memory_addr,
+    const size_t controller_memory_size,
+    const microkit_cothread_stack_pool_t *pools,
+    const int num_pools
+);
+#endif
+
+#ifndef LIBMICROKITCO_SHARED_STACK
+void microkit_cothread_init_arena(
+    co_control_t *controller_memory_addr,
+    const size_t controller_memory_size,
+    void *arena,
+    const size_t arena_size,
+    const size_t stack_size,
+    const size_t stride,
+    const size_t colour_offset
+);
+#endif
+
 bool microkit_cothread_free_handle_available(microkit_cothread_ref_t *ret_handle);
 
 microkit_cothread_ref_t microkit_cothread_spawn(const client_entry_t client_entry, void *private_arg);
+microkit_cothread_ref_t microkit_cothread_spawn_prio(const client_entry_t client_entry, void *private_arg, const microkit_cothread_prio_t priority);
+microkit_cothread_ref_t microkit_cothread_spawn_sized(const client_entry_t client_entry, void *private_arg, const size_t min_stack_size);
+microkit_cothread_ref_t microkit_cothread_spawn_joinable(const joinable_entry_t joinable_entry, void *private_arg);
+
+void microkit_cothread_join(const microkit_cothread_ref_t cothread, void **ret_value);
+
+void microkit_cothread_set_prio(const microkit_cothread_ref_t cothread, const microkit_cothread_prio_t priority);
 
 void microkit_cothread_set_arg(const microkit_cothread_ref_t cothread, void *private_arg);
 
 co_state_t microkit_cothread_query_state(const microkit_cothread_ref_t cothread);
 
+#ifdef LIBMICROKITCO_STACK_WATERMARK
+size_t microkit_cothread_stack_high_water(const microkit_cothread_ref_t cothread);
+#endif
+
 microkit_cothread_ref_t microkit_cothread_my_handle(void);
 
 void *microkit_cothread_my_arg(void);
 
 void microkit_cothread_yield(void);
+void microkit_cothread_run_ready(void);
+#ifdef LIBMICROKITCO_TIME_SLICE
+void microkit_cothread_yield_if_expired(void);
+void microkit_cothread_set_time_slice(const microkit_cothread_ref_t cothread, const uint64_t cycles);
+#endif
 
 void microkit_cothread_destroy(const microkit_cothread_ref_t cothread);
 
+#if LIBMICROKITCO_MAX_TASKS
+// Stackless tasks: scheduled like cothreads but run on the stack of whoever invokes the scheduler, so local
+// variables do not survive a yield or a wait. Keep state in the private arg.
+microkit_cothread_ref_t microkit_cothread_spawn_task(const task_entry_t task_entry, void *private_arg);
+unsigned int *microkit_cothread_task_resume_point(void);
+bool microkit_cothread_task_wait(microkit_cothread_sem_t *sem);
+
+#define MICROKIT_COTHREAD_TASK_BEGIN() switch (*microkit_cothread_task_resume_point()) { case 0:
+
+#define MICROKIT_COTHREAD_TASK_YIELD() \
+    do { *microkit_cothread_task_resume_point() = __LINE__; return co_task_yielded; case __LINE__:; } while (0)
+
+#define MICROKIT_COTHREAD_TASK_WAIT(sem) \
+    do { \
+        *microkit_cothread_task_resume_point() = __LINE__; \
+        case __LINE__: \
+        if (!microkit_cothread_task_wait(sem)) { \
+            return co_task_blocked; \
+        } \
+    } while (0)
+
+#define MICROKIT_COTHREAD_TASK_WAIT_ON_CHANNEL(ch) MICROKIT_COTHREAD_TASK_WAIT(microkit_cothread_channel_sem(ch))
+
+#define MICROKIT_COTHREAD_TASK_END() } return co_task_done
+#endif
+
 // Generic blocking mechanism: a userland semaphore
 void microkit_cothread_semaphore_init(microkit_cothread_sem_t *ret_sem);
+void microkit_cothread_semaphore_init_counting(microkit_cothread_sem_t *ret_sem, const unsigned int initial, const unsigned int max_count);
 void microkit_cothread_semaphore_wait(microkit_cothread_sem_t *sem);
+void microkit_cothread_semaphore_wait_n(microkit_cothread_sem_t *sem, const unsigned int n);
 void microkit_cothread_semaphore_signal(microkit_cothread_sem_t *sem);
+void microkit_cothread_semaphore_signal_n(microkit_cothread_sem_t *sem, const unsigned int n);
+void microkit_cothread_semaphore_signal_deferred(microkit_cothread_sem_t *sem);
+void microkit_cothread_semaphore_broadcast(microkit_cothread_sem_t *sem);
 bool microkit_cothread_semaphore_is_queue_empty(const microkit_cothread_sem_t *sem);
 bool microkit_cothread_semaphore_is_set(const microkit_cothread_sem_t *sem);
 
+// Mutual exclusion with an owner, with priority inheritance when there is more than one priority.
+void microkit_cothread_mutex_init(microkit_cothread_mutex_t *ret_mutex);
+void microkit_cothread_mutex_lock(microkit_cothread_mutex_t *mutex);
+bool microkit_cothread_mutex_trylock(microkit_cothread_mutex_t *mutex);
+void microkit_cothread_mutex_unlock(microkit_cothread_mutex_t *mutex);
+microkit_cothread_ref_t microkit_cothread_mutex_owner(const microkit_cothread_mutex_t *mutex);
+
+// Condition variables, used together with a mutex.
+void microkit_cothread_cond_init(microkit_cothread_cond_t *ret_cond);
+void microkit_cothread_cond_wait(microkit_cothread_cond_t *cond, microkit_cothread_mutex_t *mutex);
+void microkit_cothread_cond_signal(microkit_cothread_cond_t *cond);
+void microkit_cothread_cond_broadcast(microkit_cothread_cond_t *cond);
+
+// Bounded channels between cothreads, items are copied by value so pass pointers to avoid copying payloads.
+void microkit_cothread_chan_init(microkit_cothread_chan_t *ret_chan, void *buffer, const unsigned capacity, const size_t item_size);
+co_chan_result_t microkit_cothread_chan_send(microkit_cothread_chan_t *chan, const void *item);
+co_chan_result_t microkit_cothread_chan_recv(microkit_cothread_chan_t *chan, void *ret_item);
+co_chan_result_t microkit_cothread_chan_try_send(microkit_cothread_chan_t *chan, const void *item);
+co_chan_result_t microkit_cothread_chan_try_recv(microkit_cothread_chan_t *chan, void *ret_item);
+void microkit_cothread_chan_close(microkit_cothread_chan_t *chan);
+
+// Worker pools, work items are submitted without switching and run by whichever worker is free.
+int microkit_cothread_pool_init(microkit_cothread_pool_t *ret_pool, microkit_cothread_pool_work_t *ring, const unsigned capacity, const int num_workers);
+bool microkit_cothread_pool_submit(microkit_cothread_pool_t *pool, const pool_work_fn_t fn, void *arg);
+void microkit_cothread_pool_shutdown(microkit_cothread_pool_t *pool);
+
+// Futures, completed from `notified()` or another cothread and awaited by cothreads.
+void microkit_cothread_future_init(microkit_cothread_future_t *ret_future);
+void microkit_cothread_future_complete(microkit_cothread_future_t *future, void *value);
+bool microkit_cothread_future_is_complete(const microkit_cothread_future_t *future);
+void *microkit_cothread_future_await(microkit_cothread_future_t *future);
+void microkit_cothread_future_await_all(microkit_cothread_future_t *const *futures, const int n);
+int microkit_cothread_future_await_any(microkit_cothread_future_t *const *futures, const int n);
+
 // Microkit specific semaphore wrapper: blocking on channel
 void microkit_cothread_wait_on_channel(const microkit_channel wake_on); 
+microkit_cothread_sem_t *microkit_cothread_channel_sem(const microkit_channel ch);
+uint64_t microkit_cothread_wait_on_channels(const uint64_t wake_on_mask);
 void microkit_cothread_recv_ntfn(const microkit_channel ch);
+void microkit_cothread_recv_ntfn_broadcast(const microkit_channel ch);
+void microkit_cothread_event_loop(const uint64_t cothread_channels) __attribute__((noreturn));
+
+// Timed waits, require a client provided timer.
+void microkit_cothread_timer_init(const microkit_channel timer_ch, const co_timer_now_t now, const co_timer_set_timeout_t set_timeout);
+void microkit_cothread_sleep(const microkit_cothread_time_t duration);
+void microkit_cothread_sleep_until(const microkit_cothread_time_t deadline);
+co_wait_result_t microkit_cothread_semaphore_wait_timeout(microkit_cothread_sem_t *sem, const microkit_cothread_time_t timeout);
+co_wait_result_t microkit_cothread_wait_on_channel_timeout(const microkit_channel wake_on, const microkit_cothread_time_t timeout);
 
 // ========== END API SECTION ==========